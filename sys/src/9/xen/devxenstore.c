@@ -14,6 +14,7 @@
 #define LOG(a)
 
 typedef struct Aux Aux;
+typedef struct Watch Watch;
 
 enum {
 	Qtopdir,
@@ -55,9 +56,27 @@ struct Aux {
 	int	reqid;
 };
 
+/*
+ * a watch set by the kernel: xenbusproc counts its events
+ * and wakes whoever waits for them
+ */
+struct Watch {
+	Rendez;
+	Watch	*next;
+	ulong	fired;
+	ulong	seen;
+	char	path[64];
+};
+
+static struct {
+	Lock;
+	Watch	*head;
+} watches;
+
 static char Ephase[] = "phase error";
 static char Eproto[] = "protocol error";
 static char NodeShutdown[] = "control/shutdown";
+static char WatchToken[] = "$";
 
 static void xenbusproc(void*);
 
@@ -463,7 +482,7 @@ xscmd(Aux *aux, char *buf, int cmd, char *s, char *val)
 	msg->len = strlen(s)+1;
 	if (val) {
 		msg->len += strlen(val);
-		if (cmd == XS_WATCH)
+		if (cmd == XS_WATCH || cmd == XS_UNWATCH)
 			msg->len++;		/* stupid special case */
 	}
 	strcpy(arg, s);
@@ -562,6 +581,111 @@ xenstore_gets(char *dir, char *node, char *buf, int buflen)
 	return n;
 }
 
+/*
+ * read the names of the nodes under dir into val, separated by NULs;
+ * returns how many there are, or -1 if dir does not exist
+ */
+int
+xenstore_ls(char *dir, char *val, int len)
+{
+	char buf[512];
+	char *p, *e;
+	int n;
+
+	intfinit();
+	p = xscmd(xenstore.kernelaux, buf, XS_DIRECTORY, dir, nil);
+	if (p == 0)
+		return -1;
+	e = p + ((struct xsd_sockmsg*)buf)->len;
+	for (n = 0; p < e; n++) {
+		if (strlen(p) >= len)
+			break;
+		strcpy(val, p);
+		len -= strlen(p)+1;
+		val += strlen(p)+1;
+		p += strlen(p)+1;
+	}
+	return n;
+}
+
+/*
+ * set a watch on dir/node, to wait for its changes with xenstore_waitwatch
+ */
+void*
+xenstore_watch(char *dir, char *node)
+{
+	char buf[512];
+	Watch *w;
+
+	intfinit();
+	w = mallocz(sizeof(Watch), 1);
+	if (w == nil)
+		error(Enomem);
+	snprint(w->path, sizeof w->path, "%s%s", dir, node);
+	lock(&watches);
+	w->next = watches.head;
+	watches.head = w;
+	unlock(&watches);
+	xscmd(xenstore.kernelaux, buf, XS_WATCH, w->path, WatchToken);
+	return w;
+}
+
+void
+xenstore_unwatch(void *a)
+{
+	char buf[512];
+	Watch *w, **l;
+
+	w = a;
+	xscmd(xenstore.kernelaux, buf, XS_UNWATCH, w->path, WatchToken);
+	lock(&watches);
+	for (l = &watches.head; *l != nil; l = &(*l)->next)
+		if (*l == w) {
+			*l = w->next;
+			break;
+		}
+	unlock(&watches);
+	free(w);
+}
+
+static int
+watchfired(void *a)
+{
+	Watch *w = a;
+
+	return w->fired != w->seen;
+}
+
+/*
+ * wait up to ms for the watched node to change since the last call;
+ * returns 0 if it did not
+ */
+int
+xenstore_waitwatch(void *a, ulong ms)
+{
+	Watch *w = a;
+
+	tsleep(w, watchfired, w, ms);
+	if (w->fired == w->seen)
+		return 0;
+	w->seen = w->fired;
+	return 1;
+}
+
+static void
+watchevent(char *path)
+{
+	Watch *w;
+
+	lock(&watches);
+	for (w = watches.head; w != nil; w = w->next)
+		if (strcmp(w->path, path) == 0) {
+			w->fired++;
+			wakeup(w);
+		}
+	unlock(&watches);
+}
+
 static void
 xenbusproc(void*)
 {
@@ -581,8 +705,10 @@ xenbusproc(void*)
 		for (n = msg.len; n > 0; n -= m)
 			m = xsread(c, buf, msg.len, sizeof(msg));
 		buf[msg.len] = 0;
-		if (strcmp(buf, NodeShutdown) != 0)
+		if (strcmp(buf, NodeShutdown) != 0) {
+			watchevent(buf);
 			continue;
+		}
 		p = xscmd(aux, buf, XS_READ, NodeShutdown, nil);
 		if (p == nil)
 			continue;
@@ -16,50 +16,135 @@
 
 enum {
 	Nvif	= 4,
-	Ntb		= 16,
-	Nrb		= 32,
+	Nqueue	= 4,	/* most queue pairs a vif is given */
+	Ntx		= 64,	/* transmit requests in flight, by default */
+	Nrb		= 32,	/* receive buffers posted, by default */
+	Nring	= 256,	/* entries in a one page ring */
+	Rxbudget	= 64,	/* packets a polling pass takes, by default */
+	Lromax	= 32*1024,	/* largest packet coalesced */
+	Rxlow	= 4,	/* copy packets when down to this many */
+	Maxmtu	= 9000+ETHERHDRSIZE,	/* with feature-sg */
+
+	Ip4	= 0x0800,
+	Ip6	= 0x86DD,
+	Ip4hdr	= 20,
+	Ip6hdr	= 40,
+	Tcp	= 6,
+	Udp	= 17,
+	Tpsh	= 0x08,	/* TCP flags */
+	Tack	= 0x10,
 };
 
 typedef struct Ctlr Ctlr;
-typedef union Txframe Txframe;
+typedef struct Txslot Txslot;
+typedef struct Vifq Vifq;
+typedef struct Rxbuf Rxbuf;
 typedef union Rxframe Rxframe;
 
-struct Ctlr {
-	int	attached;
-	int	backend;
-	int	vifno;
-	int	evtchn;
-	int rxcopy;
-	Txframe	*txframes;
-	Txframe	*freetxframe;
-	Rxframe	*rxframes;
+/*
+ * A transmit request in flight, indexed by its id, granting
+ * the backend one page's worth of a Block.  The first slot
+ * of a packet holds the Block until all of them are answered.
+ */
+struct Txslot {
+	Txslot	*next;
+	Txslot	*head;	/* first slot of the packet */
+	int	ref;
+	Block	*bp;	/* in the head: the packet */
+	int	nfrag;	/* in the head: requests not answered yet */
+};
+
+/*
+ * A receive page, granted to the backend for good in copy
+ * mode.  A packet it holds all of goes up the stack in it,
+ * freeing the Block putting the page back in the pool.
+ */
+struct Rxbuf {
+	Block	b;	/* first, for rxfree */
+	Rxbuf	*next;
+	Ctlr	*ctlr;
+	Rxframe	*page;
+	int	ref;
+};
+
+/*
+ * A pair of rings with an event channel and a transmit kproc
+ * of their own.  Packets are spread over the queues by flow.
+ */
+struct Vifq {
+	Ctlr	*ctlr;
+	int	qno;
+	int	txevtchn;
+	int	rxevtchn;	/* the same one unless split */
+	Queue	*oq;	/* packets for this queue to send */
+	Txslot	*txslots;	/* ctlr->ntx */
+	Txslot	*freetxslot;
+	int	ntxfree;
+	int	txneed;	/* slots the next packet takes */
+	Block	*rxbp;	/* packet being received in several responses */
+	int	rxskip;	/* rest of a dropped packet to come */
+	Rxbuf	**rxslot;	/* ctlr->nrx posted, by request id */
 	netif_tx_front_ring_t txring;
 	netif_rx_front_ring_t rxring;
-	int	*txrefs;
-	int	*rxrefs;
 	int	txringref;
 	int	rxringref;
 	Lock	txlock;
-	QLock	attachlock;
-	Rendez	wtxframe;
+	Lock	rxlock;
+	int	rxpolling;	/* etherxenrxproc has the ring */
+	Block	*lro;	/* segments being coalesced */
+	uchar	*lrotcp;	/* its TCP header */
+	ulong	lroseq;	/* sequence number to follow */
+	Rendez	wtxslot;
 	Rendez	wtxblock;
+	Rendez	wrxpoll;
+};
+
+struct Ctlr {
+	Ether	*ether;
+	int	attached;
+	int	backend;
+	int	vifno;
+	int rxcopy;
+	int	sg;	/* backend takes packets in several requests */
+	int	ip6csum;	/* feature-ipv6-csum-offload */
+	int	gso4;	/* feature-gso-tcpv4 */
+	int	gso6;	/* feature-gso-tcpv6 */
+	int	split;	/* feature-split-event-channels */
+	int	rxpoll;	/* receive in etherxenrxproc */
+	int	rxbudget;
+	int	lro;	/* coalesce received TCP segments */
+	int	nq;
+	int	ntx;
+	int	nrx;
+	Vifq	*vq;
+	Rxbuf	*rxbufs;
+	Rxbuf	*rxpool;
+	int	nrxpool;
+	Lock	rxlock;
+	QLock	attachlock;
+	QLock	txqlock;	/* keeps a flow's packets in order */
 
 	ulong interrupts;
+	ulong txinterrupts;
+	ulong rxinterrupts;
+	ulong rxpolls;
 	ulong transmits;
+	ulong txpackets;
+	ulong txbursts;
+	ulong txnotifies;
+	ulong txfrags;
+	ulong txcopies;
+	ulong txcsum;
+	ulong txgso;
+	ulong rxfrags;
 	ulong receives;
+	ulong rxloans;
+	ulong rxlro;
 	ulong txerrors;
 	ulong rxerrors;
 	ulong rxoverflows;
 };
 
-union Txframe {
-	struct {
-		Txframe *next;
-		char data[2];
-	} tf;
-	uchar page[BY2PG];
-};
-
 union Rxframe {
 	uchar page[BY2PG];
 };
@@ -74,253 +159,946 @@ static int nvif;
 #define PA2MA(pa)		(MFNPG(pa) | PGOFF(pa))
 #define VA2MA(va)		PA2MA(PADDR(va))
 
-static int
-puttxrequest(Ctlr *ctlr, netif_tx_request_t *tr)
+/*
+ * the requests of a packet must all be in the ring before
+ * the backend sees any of them: txpush pushes them
+ */
+static void
+puttxrequest(Vifq *vq, netif_tx_request_t *tr)
 {
 	netif_tx_request_t *req;
-	int i, notify;
+	int i;
 
 	LOG(dprint("puttxrequest id %d ref %d size %d\n", tr->id, tr->gref, tr->size);)
-	i = ctlr->txring.req_prod_pvt;
-	req = RING_GET_REQUEST(&ctlr->txring, i);
+	i = vq->txring.req_prod_pvt;
+	req = RING_GET_REQUEST(&vq->txring, i);
 	memmove(req, tr, sizeof(*req));
-	ctlr->txring.req_prod_pvt = i+1;
-	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&ctlr->txring, notify);
-	return notify;
+	vq->txring.req_prod_pvt = i+1;
+}
+
+/*
+ * an extra info slot is smaller than a request
+ */
+static void
+puttxextra(Vifq *vq, netif_extra_info_t *ei)
+{
+	netif_extra_info_t *req;
+	int i;
+
+	i = vq->txring.req_prod_pvt;
+	req = (netif_extra_info_t*)RING_GET_REQUEST(&vq->txring, i);
+	memmove(req, ei, sizeof(*req));
+	vq->txring.req_prod_pvt = i+1;
 }
 
 static int
-putrxrequest(Ctlr *ctlr, netif_rx_request_t *rr)
+txpush(Vifq *vq)
+{
+	int notify;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&vq->txring, notify);
+	return notify;
+}
+
+/*
+ * receive buffers are posted a drain at a time: rxpush
+ */
+static void
+putrxrequest(Vifq *vq, netif_rx_request_t *rr)
 {
 	netif_rx_request_t *req;
 	int i;
-	int notify;
 
 	LOG(dprint("putrxrequest %d %d\n", rr->id, rr->gref);)
-	i = ctlr->rxring.req_prod_pvt;
-	req = RING_GET_REQUEST(&ctlr->rxring, i);
+	i = vq->rxring.req_prod_pvt;
+	req = RING_GET_REQUEST(&vq->rxring, i);
 	memmove(req, rr, sizeof(*req));
-	ctlr->rxring.req_prod_pvt = i+1;
-	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&ctlr->rxring, notify);
-	return notify;
+	vq->rxring.req_prod_pvt = i+1;
 }
 
-static int
-gettxresponse(Ctlr *ctlr, netif_tx_response_t *tr)
+/*
+ * let the backend see the buffers posted, and wake it on the
+ * rx channel if it ran out of them
+ */
+static void
+rxpush(Vifq *vq)
 {
-	int i, avail;
-	netif_tx_response_t *rx;
+	int notify;
 
-	RING_FINAL_CHECK_FOR_RESPONSES(&ctlr->txring, avail);
-	if (!avail)
-		return 0;
-	i = ctlr->txring.rsp_cons;
-	rx = RING_GET_RESPONSE(&ctlr->txring, i);
-	LOG(dprint("gettxresponse id %d status %d\n", rx->id, rx->status);)
-	if(rx->status)
-		ctlr->txerrors++;
-	*tr = *rx;
-	ctlr->txring.rsp_cons = ++i;
-	return 1;
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&vq->rxring, notify);
+	if (notify)
+		xenchannotify(vq->rxevtchn);
 }
 
+/*
+ * leaves rsp_event alone: the backend is asked for another
+ * notification only by RING_FINAL_CHECK_FOR_RESPONSES, once
+ * the ring is found empty
+ */
 static int
-getrxresponse(Ctlr *ctlr, netif_rx_response_t* rr)
+getrxresponse(Vifq *vq, netif_rx_response_t* rr)
 {
-	int i, avail;
+	int i;
 	netif_rx_response_t *rx;
 
-	RING_FINAL_CHECK_FOR_RESPONSES(&ctlr->rxring, avail);
-	if (!avail)
+	if (!RING_HAS_UNCONSUMED_RESPONSES(&vq->rxring))
 		return 0;
-	i = ctlr->rxring.rsp_cons;
-	rx = RING_GET_RESPONSE(&ctlr->rxring, i);
+	i = vq->rxring.rsp_cons;
+	rx = RING_GET_RESPONSE(&vq->rxring, i);
 	LOG(dprint("getrxresponse id %d offset %d flags %ux status %d\n", rx->id, rx->offset, rx->flags, rx->status);)
 	*rr = *rx;
-	ctlr->rxring.rsp_cons = ++i;
+	vq->rxring.rsp_cons = ++i;
 	return 1;
 }
 
 static int
-ringinit(Ctlr *ctlr, char *a)
+ringinit(Vifq *vq, char *a)
 {
 	netif_tx_sring_t *txr;
 	netif_rx_sring_t *rxr;
+	int backend;
 
+	backend = vq->ctlr->backend;
 	txr = (netif_tx_sring_t*)a;
 	memset(txr, 0, BY2PG);
 	SHARED_RING_INIT(txr);
-	FRONT_RING_INIT(&ctlr->txring, txr, BY2PG);
-	ctlr->txringref = shareframe(ctlr->backend, txr, 1);
+	FRONT_RING_INIT(&vq->txring, txr, BY2PG);
+	vq->txringref = shareframe(backend, txr, 1);
 
 	rxr = (netif_rx_sring_t*)(a+BY2PG);
 	SHARED_RING_INIT(rxr);
-	FRONT_RING_INIT(&ctlr->rxring, rxr, BY2PG);
-	ctlr->rxringref = shareframe(ctlr->backend, rxr, 1);
+	FRONT_RING_INIT(&vq->rxring, rxr, BY2PG);
+	vq->rxringref = shareframe(backend, rxr, 1);
 
 	return 2*BY2PG;
 }
 
+#define GET16(p)	((p)[0]<<8 | (p)[1])
+#define GET32(p)	((ulong)GET16(p)<<16 | GET16((p)+2))
+#define PUT16(p, v)	((p)[0] = (v)>>8, (p)[1] = (v))
+
+/*
+ * one's complement sum of n bytes of IP addresses
+ */
+static ulong
+addrsum(uchar *p, int n, ulong sum)
+{
+	for (; n > 0; n -= 2, p += 2)
+		sum += GET16(p);
+	return sum;
+}
+
+/*
+ * hash of the flow a packet is in: its addresses and, for TCP
+ * and UDP, ports, so a connection keeps to one queue.
+ * Fragments are hashed on addresses alone, as the ports are
+ * only in the first.
+ */
+static ulong
+txhash(Block *bp)
+{
+	uchar *p, *a, *l4;
+	ulong h;
+	int n, proto;
+
+	if (BLEN(bp) < ETHERHDRSIZE)
+		return 0;
+	p = bp->rp + ETHERHDRSIZE;
+	switch (GET16(bp->rp+12)) {
+	case Ip4:
+		if (bp->wp - p < Ip4hdr)
+			return 0;
+		proto = p[9];
+		a = p + 12;
+		n = 8;
+		l4 = nil;
+		if ((GET16(p+6) & 0x3FFF) == 0)
+			l4 = p + (p[0]&0xF)*4;
+		break;
+	case Ip6:
+		if (bp->wp - p < Ip6hdr)
+			return 0;
+		proto = p[6];
+		a = p + 8;
+		n = 32;
+		l4 = p + Ip6hdr;
+		break;
+	default:
+		return 0;
+	}
+	h = 0;
+	while (n-- > 0)
+		h = h*31 + *a++;
+	if ((proto == Tcp || proto == Udp) && l4 != nil && l4+4 <= bp->wp)
+		h = (h*31 + GET16(l4))*31 + GET16(l4+2);
+	return h ^ h>>16;
+}
+
+/*
+ * The TCP and UDP checksums of a Block sent with Btcpck or
+ * Budpck set are left to the device: put the pseudo-header sum
+ * in the checksum field, for the backend to finish as
+ * NETTXF_csum_blank asks.  Checksums the IP stack did compute
+ * are marked NETTXF_data_validated, so other domains need
+ * not check them again.
+ * A TCP packet bigger than the mtu is a super-segment for the
+ * backend to cut into segments that fit: fill in gso for it.
+ * Returns the flags for the request, or -1 if the packet
+ * cannot be sent.
+ */
 static int
-vifsend(Ctlr *ctlr, Block *bp)
+txoffload(Ctlr *ctlr, Block *bp, int mtu, netif_extra_info_t *gso)
 {
-	netif_tx_request_t tr;
-	Txframe *tx;
-	int id;
-
-	ilock(&ctlr->txlock);
-	tx = ctlr->freetxframe;
-	ctlr->freetxframe = tx->tf.next;
-	iunlock(&ctlr->txlock);
-	id = tx - ctlr->txframes;
-	tr.gref = ctlr->txrefs[id];
-	tr.offset = tx->tf.data - (char*)tx;
-	tr.flags = 0;	// XXX checksum?
-	tr.id = id;
-	tr.size = BLEN(bp);
-	memmove(tx->tf.data, bp->rp, tr.size);
-	return puttxrequest(ctlr, &tr);
+	uchar *p, *l4;
+	ulong sum;
+	int proto, len, off, big, v6;
+
+	big = BLEN(bp) > mtu;
+	p = bp->rp + ETHERHDRSIZE;
+	if (BLEN(bp) < ETHERHDRSIZE)
+		return big ? -1 : 0;
+	switch (GET16(bp->rp+12)) {
+	case Ip4:
+		if (bp->wp - p < Ip4hdr || (GET16(p+6) & 0x3FFF) != 0)
+			return big ? -1 : 0;	/* fragments have no L4 header of their own */
+		proto = p[9];
+		l4 = p + (p[0]&0xF)*4;
+		len = GET16(p+2) - (l4 - p);
+		sum = addrsum(p+12, 8, 0);
+		v6 = 0;
+		break;
+	case Ip6:
+		if (bp->wp - p < Ip6hdr || !ctlr->ip6csum)
+			return big ? -1 : 0;
+		proto = p[6];	/* no extension headers */
+		l4 = p + Ip6hdr;
+		len = GET16(p+4);
+		sum = addrsum(p+8, 32, 0);
+		v6 = 1;
+		break;
+	default:
+		return big ? -1 : 0;
+	}
+	switch (proto) {
+	case Tcp:
+		off = 16;
+		break;
+	case Udp:
+		off = 6;
+		break;
+	default:
+		return big ? -1 : 0;
+	}
+	if (l4 + off + 2 > bp->wp || len < off + 2)
+		return big ? -1 : 0;
+	if (big) {
+		if (proto != Tcp || !(v6 ? ctlr->gso6 : ctlr->gso4))
+			return -1;
+		memset(gso, 0, sizeof *gso);
+		gso->type = XEN_NETIF_EXTRA_TYPE_GSO;
+		gso->u.gso.type = v6 ? XEN_NETIF_GSO_TYPE_TCPV6 : XEN_NETIF_GSO_TYPE_TCPV4;
+		/* each segment repeats the headers, options and all */
+		gso->u.gso.size = mtu - (l4 + (l4[12]>>4)*4 - bp->rp);
+		ctlr->txgso++;
+	} else if ((bp->flag & (Btcpck|Budpck)) == 0)
+		return NETTXF_data_validated;
+	sum += proto + len;
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	l4[off] = sum >> 8;
+	l4[off+1] = sum;
+	ctlr->txcsum++;
+	if (big)
+		return NETTXF_csum_blank|NETTXF_data_validated|NETTXF_extra_info;
+	return NETTXF_csum_blank|NETTXF_data_validated;
+}
+
+/*
+ * the backend wants at least the Ethernet header in the first
+ * request of a packet: copy one whose first page holds less
+ */
+static Block*
+txrealign(Ctlr *ctlr, Block *bp)
+{
+	Block *nbp;
+	int n;
+
+	n = BY2PG - PGOFF((ulong)bp->rp);
+	if (n >= ETHERHDRSIZE || n >= BLEN(bp))
+		return bp;
+	nbp = allocb(BLEN(bp) + ETHERHDRSIZE);
+	n = BY2PG - PGOFF((ulong)nbp->rp);
+	if (n < ETHERHDRSIZE) {
+		nbp->rp += n;
+		nbp->wp = nbp->rp;
+	}
+	memmove(nbp->wp, bp->rp, BLEN(bp));
+	nbp->wp += BLEN(bp);
+	nbp->flag |= bp->flag & (Btcpck|Budpck);
+	freeb(bp);
+	ctlr->txcopies++;
+	return nbp;
 }
 
+/*
+ * the pages a packet touches, each taking a request
+ */
 static int
-vifsenddone(Ctlr *ctlr, netif_tx_response_t *tr)
+txslots(Block *bp)
 {
-	Txframe *tx;
+	return (PGOFF((ulong)bp->rp) + BLEN(bp) + BY2PG-1) / BY2PG;
+}
 
-	tx = &ctlr->txframes[tr->id];	// XXX check validity of id
-	ilock(&ctlr->txlock);
-	tx->tf.next = ctlr->freetxframe;
-	ctlr->freetxframe = tx;
-	iunlock(&ctlr->txlock);
-	return 1;
+/*
+ * queue bp for transmission, granting the backend each page of
+ * it in place; the first request carries the size of the whole
+ * packet, and all but the last have NETTXF_more_data.
+ * The GSO extra info of a super-segment follows the first.
+ * bp is kept until the backend has answered them all.
+ * Nothing is pushed: etherxenproc does that once a burst.
+ */
+static void
+vifsend(Vifq *vq, Block *bp, int mtu)
+{
+	Ctlr *ctlr;
+	netif_tx_request_t tr;
+	netif_extra_info_t gso;
+	Txslot *ts, *head, *slot[XEN_NETIF_NR_SLOTS_MIN];
+	uchar *p;
+	int i, n, nslot, flags;
+
+	ctlr = vq->ctlr;
+	if ((flags = txoffload(ctlr, bp, mtu, &gso)) < 0) {
+		ctlr->txerrors++;
+		freeb(bp);
+		return;
+	}
+	nslot = txslots(bp);
+	ilock(&vq->txlock);
+	for (i = 0; i < nslot; i++) {
+		slot[i] = vq->freetxslot;
+		vq->freetxslot = slot[i]->next;
+	}
+	vq->ntxfree -= nslot;
+	iunlock(&vq->txlock);
+	head = slot[0];
+	head->bp = bp;
+	head->nfrag = nslot;
+	p = bp->rp;
+	for (i = 0; i < nslot; i++, p += n) {
+		ts = slot[i];
+		ts->head = head;
+		n = BY2PG - PGOFF((ulong)p);
+		if (n > bp->wp - p)
+			n = bp->wp - p;
+		ts->ref = shareframe(ctlr->backend, p, 0);
+		tr.gref = ts->ref;
+		tr.offset = PGOFF((ulong)p);
+		tr.flags = i == 0 ? flags : 0;
+		if (i < nslot-1)
+			tr.flags |= NETTXF_more_data;
+		tr.id = ts - vq->txslots;
+		tr.size = i == 0 ? BLEN(bp) : n;
+		puttxrequest(vq, &tr);
+		if (i == 0 && flags & NETTXF_extra_info)
+			puttxextra(vq, &gso);
+	}
+	if (nslot > 1)
+		ctlr->txfrags++;
+	ctlr->txpackets++;
 }
 
+/*
+ * take back the slots of all the transmit requests answered,
+ * freeing the packets once done with, in one go
+ */
 static int
-vifrecv(Ctlr *ctlr, Rxframe *rx)
+txreclaim(Vifq *vq)
 {
-	netif_rx_request_t rr;
-	int id;
-	int ref;
+	Ctlr *ctlr;
+	netif_tx_response_t *rsp;
+	Txslot *ts, *head;
+	Block *bp, *done;
+	int i, n, more;
 
-	id = rx - ctlr->rxframes;
-	if (ctlr->rxcopy)
-		ref = ctlr->rxrefs[id];
-	else {
-		ref = donateframe(ctlr->backend, rx);
-		ctlr->rxrefs[id] = ref;
+	ctlr = vq->ctlr;
+	done = nil;
+	n = 0;
+	ilock(&vq->txlock);
+	do {
+		while (RING_HAS_UNCONSUMED_RESPONSES(&vq->txring)) {
+			i = vq->txring.rsp_cons;
+			rsp = RING_GET_RESPONSE(&vq->txring, i);
+			vq->txring.rsp_cons = ++i;
+			LOG(dprint("txreclaim id %d status %d\n", rsp->id, rsp->status);)
+			/* the answer to an extra info slot */
+			if (rsp->status == NETIF_RSP_NULL)
+				continue;
+			if (rsp->status != NETIF_RSP_OKAY)
+				ctlr->txerrors++;
+			if (rsp->id >= ctlr->ntx) {
+				print("etherxen: vif %d: bogus tx response id %d\n", ctlr->vifno, rsp->id);
+				continue;
+			}
+			ts = &vq->txslots[rsp->id];
+			xengrantend(ts->ref);
+			head = ts->head;
+			/* the head slot goes last, keeping the packet's count */
+			if (ts != head) {
+				ts->next = vq->freetxslot;
+				vq->freetxslot = ts;
+				vq->ntxfree++;
+			}
+			if (--head->nfrag == 0) {
+				bp = head->bp;
+				head->bp = nil;
+				bp->next = done;
+				done = bp;
+				head->next = vq->freetxslot;
+				vq->freetxslot = head;
+				vq->ntxfree++;
+			}
+			n++;
+		}
+		RING_FINAL_CHECK_FOR_RESPONSES(&vq->txring, more);
+	} while (more);
+	iunlock(&vq->txlock);
+	while ((bp = done) != nil) {
+		done = bp->next;
+		bp->next = nil;
+		freeb(bp);
 	}
+	if (n > 0)
+		wakeup(&vq->wtxslot);
+	return n;
+}
+
+static void
+vifrecv(Vifq *vq, int id)
+{
+	netif_rx_request_t rr;
+	Rxbuf *rb;
+
+	rb = vq->rxslot[id];
+	if (!vq->ctlr->rxcopy)
+		rb->ref = donateframe(vq->ctlr->backend, rb->page);
 	rr.id = id;
-	rr.gref = ref;
-	return putrxrequest(ctlr, &rr);
+	rr.gref = rb->ref;
+	putrxrequest(vq, &rr);
+}
+
+static void
+rxfree(Block *bp)
+{
+	Rxbuf *rb;
+	Ctlr *ctlr;
+
+	rb = (Rxbuf*)bp;
+	ctlr = rb->ctlr;
+	ilock(&ctlr->rxlock);
+	rb->next = ctlr->rxpool;
+	ctlr->rxpool = rb;
+	ctlr->nrxpool++;
+	iunlock(&ctlr->rxlock);
+}
+
+/*
+ * lend the page of request id, holding len bytes at off, to
+ * the stack as a Block, and put a spare from the pool in its
+ * place; nil when the pool is low, for the caller to copy
+ */
+static Block*
+rxloan(Vifq *vq, int id, int off, int len)
+{
+	Ctlr *ctlr;
+	Rxbuf *rb, *spare;
+	Block *bp;
+
+	ctlr = vq->ctlr;
+	ilock(&ctlr->rxlock);
+	if (ctlr->nrxpool <= Rxlow) {
+		iunlock(&ctlr->rxlock);
+		return nil;
+	}
+	spare = ctlr->rxpool;
+	ctlr->rxpool = spare->next;
+	ctlr->nrxpool--;
+	iunlock(&ctlr->rxlock);
+	rb = vq->rxslot[id];
+	vq->rxslot[id] = spare;
+	bp = &rb->b;
+	memset(bp, 0, sizeof(Block));
+	bp->base = rb->page->page;
+	bp->lim = bp->base + BY2PG;
+	bp->rp = bp->base + off;
+	bp->wp = bp->rp + len;
+	bp->free = rxfree;
+	ctlr->rxloans++;
+	return bp;
+}
+
+/*
+ * Receive coalescing: consecutive in-order segments of a TCP
+ * flow, their checksums vouched for by the backend
+ * (NETRXF_data_validated), are merged in vq->lro into one
+ * packet, which the stack processes and acknowledges once.
+ * Whatever is held goes up at the end of each drain of the ring.
+ */
+
+/*
+ * the TCP header of a segment that may be coalesced, or nil
+ */
+static uchar*
+lrotcp(Block *bp)
+{
+	uchar *p, *tcp;
+	int hl;
+
+	if ((bp->flag & Btcpck) == 0 || BLEN(bp) < ETHERHDRSIZE + Ip4hdr)
+		return nil;
+	p = bp->rp + ETHERHDRSIZE;
+	switch (GET16(bp->rp+12)) {
+	case Ip4:
+		/* no options, fragments or padding */
+		if (p[0] != 0x45 || p[9] != Tcp || (GET16(p+6) & 0x3FFF) != 0
+		|| GET16(p+2) != bp->wp - p)
+			return nil;
+		tcp = p + Ip4hdr;
+		break;
+	case Ip6:
+		/* no extension headers */
+		if (bp->wp - p < Ip6hdr || p[6] != Tcp
+		|| GET16(p+4) != bp->wp - p - Ip6hdr)
+			return nil;
+		tcp = p + Ip6hdr;
+		break;
+	default:
+		return nil;
+	}
+	if (tcp + 20 > bp->wp)
+		return nil;
+	hl = (tcp[12]>>4)*4;
+	if (hl < 20 || tcp + hl > bp->wp)
+		return nil;
+	/* nothing but an ACK, perhaps pushed */
+	if ((tcp[13] & ~Tpsh) != Tack)
+		return nil;
+	return tcp;
+}
+
+static void
+lroflush(Vifq *vq)
+{
+	Block *bp;
+
+	if ((bp = vq->lro) == nil)
+		return;
+	vq->lro = nil;
+	etheriq(vq->ctlr->ether, bp, 1);
 }
 
+/*
+ * whether the segment with TCP header tcp carries on from the
+ * one held: same flow, next in sequence, same ACK and options
+ */
+static int
+lromatch(Vifq *vq, Block *bp, uchar *tcp)
+{
+	Block *lro;
+	uchar *ltcp, *ip, *lip;
+	int hl;
+
+	lro = vq->lro;
+	ltcp = vq->lrotcp;
+	ip = bp->rp + ETHERHDRSIZE;
+	lip = lro->rp + ETHERHDRSIZE;
+	hl = (tcp[12]>>4)*4;
+	if (GET16(bp->rp+12) != GET16(lro->rp+12)
+	|| hl != (ltcp[12]>>4)*4
+	|| memcmp(tcp, ltcp, 4) != 0
+	|| GET32(tcp+4) != vq->lroseq
+	|| GET32(tcp+8) != GET32(ltcp+8)
+	|| memcmp(tcp+20, ltcp+20, hl-20) != 0)
+		return 0;
+	if (GET16(bp->rp+12) == Ip4)
+		return memcmp(ip+12, lip+12, 8) == 0;
+	return memcmp(ip+8, lip+8, 32) == 0;
+}
+
+/*
+ * append the payload of bp to the packet held, making a bigger
+ * Block for it if it has no room, and fix up its headers
+ */
 static int
-vifrecvdone(Ether *ether, netif_rx_response_t *rr)
+lroappend(Vifq *vq, Block *bp, uchar *tcp)
 {
+	Block *lro, *nbp;
+	uchar *ip, *ltcp, *data;
+	ulong sum;
+	int i, len;
+
+	lro = vq->lro;
+	data = tcp + (tcp[12]>>4)*4;
+	len = bp->wp - data;
+	if (BLEN(lro) + len > Lromax)
+		return 0;
+	if (lro->lim - lro->wp < len) {
+		if ((nbp = iallocb(Lromax)) == nil)
+			return 0;
+		memmove(nbp->wp, lro->rp, BLEN(lro));
+		nbp->wp += BLEN(lro);
+		nbp->flag |= lro->flag;
+		vq->lrotcp = nbp->rp + (vq->lrotcp - lro->rp);
+		freeb(lro);
+		vq->lro = lro = nbp;
+	}
+	memmove(lro->wp, data, len);
+	lro->wp += len;
+	vq->lroseq += len;
+	ltcp = vq->lrotcp;
+	ltcp[13] |= tcp[13] & Tpsh;
+	memmove(ltcp+14, tcp+14, 2);	/* window */
+	ip = lro->rp + ETHERHDRSIZE;
+	if (GET16(lro->rp+12) == Ip6) {
+		PUT16(ip+4, lro->wp - ip - Ip6hdr);
+		return 1;
+	}
+	PUT16(ip+2, lro->wp - ip);
+	ip[10] = ip[11] = 0;
+	sum = 0;
+	for (i = 0; i < Ip4hdr; i += 2)
+		sum += GET16(ip+i);
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	PUT16(ip+10, ~sum);
+	return 1;
+}
+
+/*
+ * pass bp up the stack, or hold it to coalesce with those after
+ */
+static void
+rxdeliver(Vifq *vq, Block *bp)
+{
+	uchar *tcp, *data;
+
+	if (!vq->ctlr->lro || (tcp = lrotcp(bp)) == nil) {
+		lroflush(vq);
+		etheriq(vq->ctlr->ether, bp, 1);
+		return;
+	}
+	data = tcp + (tcp[12]>>4)*4;
+	if (vq->lro != nil && data < bp->wp && lromatch(vq, bp, tcp)
+	&& lroappend(vq, bp, tcp)) {
+		freeb(bp);
+		vq->ctlr->rxlro++;
+		if (vq->lrotcp[13] & Tpsh)
+			lroflush(vq);
+		return;
+	}
+	lroflush(vq);
+	/* pure ACKs and pushed segments have nothing to wait for */
+	if (data == bp->wp || tcp[13] & Tpsh) {
+		etheriq(vq->ctlr->ether, bp, 1);
+		return;
+	}
+	vq->lro = bp;
+	vq->lrotcp = tcp;
+	vq->lroseq = GET32(tcp+4) + (bp->wp - data);
+}
+
+/*
+ * a packet may come in several responses with NETRXF_more_data,
+ * collected in vq->rxbp; one in a single response is passed
+ * up in its page while the pool has spares
+ */
+static int
+vifrecvdone(Vifq *vq, netif_rx_response_t *rr)
+{
+	Ether *ether;
 	Ctlr *ctlr;
 	Rxframe *rx;
 	Block *bp;
-	int len;
+	int id, len, more;
 
-	ctlr = ether->ctlr;
-	rx = &ctlr->rxframes[rr->id];	// XXX check validity of id
+	ctlr = vq->ctlr;
+	ether = ctlr->ether;
+	if (rr->id >= ctlr->nrx) {
+		print("etherxen: vif %d: bogus rx response id %d\n", ctlr->vifno, rr->id);
+		return 1;
+	}
+	id = rr->id;
+	rx = vq->rxslot[id]->page;
 	if (!ctlr->rxcopy)
-		acceptframe(ctlr->rxrefs[rr->id], rx);
+		acceptframe(vq->rxslot[id]->ref, rx);
+	more = rr->flags & NETRXF_more_data;
+	if (vq->rxskip) {
+		vq->rxskip = more;
+		vifrecv(vq, id);
+		return 1;
+	}
+	bp = vq->rxbp;
 	if ((len = rr->status) <= 0) {
 		ctlr->rxerrors++;
-		vifrecv(ctlr, rx);
-		return 1;
+		goto drop;
 	}
-	if(len > sizeof(Etherpkt) || (bp = iallocb(sizeof(Etherpkt))) == nil) {
+	if (bp == nil) {
+		if (len > ether->maxmtu) {
+			ctlr->rxoverflows++;
+			goto drop;
+		}
+		if (ctlr->rxcopy && !more
+		&& (bp = rxloan(vq, id, rr->offset, len)) != nil) {
+			if (rr->flags & NETRXF_data_validated)
+				bp->flag |= Btcpck|Budpck;
+			vifrecv(vq, id);
+			ctlr->receives++;
+			rxdeliver(vq, bp);
+			return 0;
+		}
+		if ((bp = iallocb(more ? ether->maxmtu : sizeof(Etherpkt))) == nil) {
+			ctlr->rxoverflows++;
+			goto drop;
+		}
+		if (rr->flags & NETRXF_data_validated)
+			bp->flag |= Btcpck|Budpck;
+	} else if (len > bp->lim - bp->wp) {
 		ctlr->rxoverflows++;
-		vifrecv(ctlr, rx);
-		return 1;
+		goto drop;
 	}
-
+	memmove(bp->wp, rx->page + rr->offset, len);
+	bp->wp += len;
+	vifrecv(vq, id);
+	if (more) {
+		vq->rxbp = bp;
+		return 0;
+	}
+	if (vq->rxbp != nil)
+		ctlr->rxfrags++;
+	vq->rxbp = nil;
 	ctlr->receives++;
-	memmove(bp->base, rx->page + rr->offset, len);
-	vifrecv(ctlr, rx);
-
-	bp->rp = bp->base;
-	bp->wp = bp->rp + len;
-	bp->free = 0;
-	bp->next = 0;
-	bp->list = 0;
-	if (rr->flags & NETRXF_data_validated)
-		bp->flag |= Btcpck|Budpck;
-	etheriq(ether, bp, 1);
+	rxdeliver(vq, bp);
 	return 0;
+
+drop:
+	/* and whatever is left of it */
+	if (bp != nil)
+		freeb(bp);
+	vq->rxbp = nil;
+	vq->rxskip = more;
+	vifrecv(vq, id);
+	return 1;
 }
 
+/*
+ * room for the next packet: its slots, and ring entries for
+ * them and a GSO extra, which takes no slot
+ */
 static int
-wtxframe(void *a)
+wtxslot(void *a)
 {
-	return ((struct Ctlr*)a)->freetxframe != 0;
+	Vifq *vq = a;
+
+	return vq->ntxfree >= vq->txneed
+	&& RING_FREE_REQUESTS(&vq->txring) > vq->txneed;
 }
 
 static int
 wtxblock(void *a)
 {
-	return qcanread(((struct Ether*)a)->oq);
+	return qcanread(((Vifq*)a)->oq);
 }
 
+/*
+ * send what is queued in bursts of as many packets as there
+ * are slots for, with one push and at most one notify each
+ */
 static void
 etherxenproc(void *a)
 {
-	Ether *ether = a;
-	Ctlr *ctlr = ether->ctlr;
+	Vifq *vq = a;
+	Ctlr *ctlr = vq->ctlr;
+	Ether *ether = ctlr->ether;
 	Block *bp;
-	int notify;
+	int n;
 
+	bp = nil;
 	for (;;) {
-		while (ctlr->freetxframe == 0)
-			sleep(&ctlr->wtxframe, wtxframe, ctlr);
-		while ((bp = qget(ether->oq)) == 0)
-			sleep(&ctlr->wtxblock, wtxblock, ether);
-		notify = vifsend(ctlr, bp);
-		freeb(bp);
-		if (notify)
-			xenchannotify(ctlr->evtchn);
+		for (n = 0; bp != nil || (bp = qget(vq->oq)) != nil; n++) {
+			bp = txrealign(ctlr, bp);
+			if (BLEN(bp) <= 0 || BLEN(bp) > XEN_NETIF_MAX_TX_SIZE
+			|| txslots(bp) > XEN_NETIF_NR_SLOTS_MIN) {
+				ctlr->txerrors++;
+				freeb(bp);
+				bp = nil;
+				continue;
+			}
+			vq->txneed = txslots(bp);
+			if (!wtxslot(vq))
+				txreclaim(vq);
+			if (!wtxslot(vq))
+				break;
+			vifsend(vq, bp, ether->mtu);
+			bp = nil;
+		}
+		if (n > 0) {
+			ctlr->txbursts++;
+			if (txpush(vq)) {
+				ctlr->txnotifies++;
+				xenchannotify(vq->txevtchn);
+			}
+		}
+		if (bp == nil)
+			sleep(&vq->wtxblock, wtxblock, vq);
+		else
+			sleep(&vq->wtxslot, wtxslot, vq);
 	}
 }
 
+/*
+ * with one queue its kproc takes from ether->oq; with more,
+ * packets are passed to the queue their flow hashes to
+ */
 static void
 etherxentransmit(Ether *ether)
 {
 	Ctlr *ctlr;
-	
+	Vifq *vq;
+	Block *bp;
+	int i;
+
 	ctlr = ether->ctlr;
 	ctlr->transmits++;
-	wakeup(&ctlr->wtxblock);
+	if (ctlr->nq == 1) {
+		wakeup(&ctlr->vq[0].wtxblock);
+		return;
+	}
+	qlock(&ctlr->txqlock);
+	while ((bp = qget(ether->oq)) != nil) {
+		vq = &ctlr->vq[txhash(bp) % ctlr->nq];
+		if (qpass(vq->oq, bp) < 0)
+			ctlr->txerrors++;
+	}
+	qunlock(&ctlr->txqlock);
+	for (i = 0; i < ctlr->nq; i++)
+		if (qcanread(ctlr->vq[i].oq))
+			wakeup(&ctlr->vq[i].wtxblock);
 }
 
 static void
-etherxenintr(Ureg*, void *a)
+rxdrain(Vifq *vq)
 {
-	Ether *ether = a;
-	Ctlr *ctlr = ether->ctlr;
-	int txnotify;
-	netif_tx_response_t tr;
 	netif_rx_response_t rr;
+	int more;
+
+	do {
+		while (getrxresponse(vq, &rr))
+			vifrecvdone(vq, &rr);
+		RING_FINAL_CHECK_FOR_RESPONSES(&vq->rxring, more);
+	} while (more);
+	lroflush(vq);
+	rxpush(vq);
+}
 
-	ctlr->interrupts++;
-	txnotify = 0;
-	while (getrxresponse(ctlr, &rr))
-		vifrecvdone(ether, &rr);
-	while (gettxresponse(ctlr, &tr)) {
-		if (vifsenddone(ctlr, &tr))
-			txnotify = 1;
+/*
+ * In polling mode the interrupt hands the ring to
+ * etherxenrxproc instead of draining it.  The backend is not
+ * asked to notify again until the kproc finds the ring empty,
+ * so a flood of packets costs one interrupt, not one each.
+ */
+static void
+rxintr(Vifq *vq)
+{
+	int poll;
+
+	ilock(&vq->rxlock);
+	poll = vq->ctlr->rxpoll || vq->rxpolling;
+	if (poll)
+		vq->rxpolling = 1;
+	iunlock(&vq->rxlock);
+	if (poll)
+		wakeup(&vq->wrxpoll);
+	else
+		rxdrain(vq);
+}
+
+static int
+wrxpoll(void *a)
+{
+	return ((Vifq*)a)->rxpolling;
+}
+
+/*
+ * take at most rxbudget packets a pass, letting others run
+ * in between, until the ring is empty
+ */
+static void
+etherxenrxproc(void *a)
+{
+	Vifq *vq = a;
+	Ctlr *ctlr = vq->ctlr;
+	netif_rx_response_t rr;
+	int n, more;
+
+	for (;;) {
+		sleep(&vq->wrxpoll, wrxpoll, vq);
+		ctlr->rxpolls++;
+		for (n = 0; n < ctlr->rxbudget && getrxresponse(vq, &rr); n++)
+			vifrecvdone(vq, &rr);
+		lroflush(vq);
+		rxpush(vq);
+		if (n == ctlr->rxbudget) {
+			sched();
+			continue;
+		}
+		ilock(&vq->rxlock);
+		RING_FINAL_CHECK_FOR_RESPONSES(&vq->rxring, more);
+		vq->rxpolling = more;
+		iunlock(&vq->rxlock);
 	}
-	if (txnotify)
-		wakeup(&ctlr->wtxframe);
+}
+
+/*
+ * with split event channels receiving and transmit completions
+ * each have a handler, and neither waits for the other
+ */
+static void
+etherxenrxintr(Ureg*, void *a)
+{
+	Vifq *vq = a;
+
+	vq->ctlr->rxinterrupts++;
+	rxintr(vq);
+}
+
+static void
+etherxentxintr(Ureg*, void *a)
+{
+	Vifq *vq = a;
+
+	vq->ctlr->txinterrupts++;
+	txreclaim(vq);
+}
+
+static void
+etherxenintr(Ureg*, void *a)
+{
+	Vifq *vq = a;
+
+	vq->ctlr->interrupts++;
+	rxintr(vq);
+	txreclaim(vq);
 }
 
 static long
 etherxenctl(Ether *ether, void *buf, long n)
 {
 	uchar ea[Eaddrlen];
+	Ctlr *ctlr;
 	Cmdbuf *cb;
+	int i;
 
+	ctlr = ether->ctlr;
 	cb = parsecmd(buf, n);
 	if(cb->nf >= 2
 	&& strcmp(cb->f[0], "ea")==0
@@ -330,26 +1108,77 @@ etherxenctl(Ether *ether, void *buf, long n)
 		memmove(ether->addr, ether->ea, Eaddrlen);
 		return 0;
 	}
+	if(cb->nf == 2
+	&& strcmp(cb->f[0], "rxpoll")==0
+	&& (strcmp(cb->f[1], "on")==0 || strcmp(cb->f[1], "off")==0)){
+		ctlr->rxpoll = strcmp(cb->f[1], "on")==0;
+		free(cb);
+		return 0;
+	}
+	if(cb->nf == 2
+	&& strcmp(cb->f[0], "lro")==0
+	&& (strcmp(cb->f[1], "on")==0 || strcmp(cb->f[1], "off")==0)){
+		ctlr->lro = strcmp(cb->f[1], "on")==0;
+		free(cb);
+		return 0;
+	}
+	if(cb->nf == 2
+	&& strcmp(cb->f[0], "rxbudget")==0
+	&& (i = strtol(cb->f[1], 0, 0)) > 0){
+		ctlr->rxbudget = i;
+		free(cb);
+		return 0;
+	}
 	free(cb);
 	error(Ebadctl);
 	return -1;	/* not reached */
 }
 
+static void
+vifqconnect(Vifq *vq, char *dir)
+{
+	xenstore_setd(dir, "tx-ring-ref", vq->txringref);
+	xenstore_setd(dir, "rx-ring-ref", vq->rxringref);
+	if (vq->ctlr->split) {
+		xenstore_setd(dir, "event-channel-tx", vq->txevtchn);
+		xenstore_setd(dir, "event-channel-rx", vq->rxevtchn);
+	} else
+		xenstore_setd(dir, "event-channel", vq->txevtchn);
+}
+
 static void
 backendconnect(Ctlr *ctlr)
 {
 	char dir[64];
+	char qdir[64];
 	char fdir[64];
 	char buf[64];
+	int i;
 
 	sprint(dir, "device/vif/%d/", ctlr->vifno);
 	xenstore_setd(dir, "state", XenbusStateInitialising);
-	xenstore_setd(dir, "tx-ring-ref", ctlr->txringref);
-	xenstore_setd(dir, "rx-ring-ref", ctlr->rxringref);
-	xenstore_setd(dir, "event-channel", ctlr->evtchn);
+	/* a single queue is where it was before there were more */
+	if (ctlr->nq == 1)
+		vifqconnect(&ctlr->vq[0], dir);
+	else {
+		xenstore_setd(dir, "multi-queue-num-queues", ctlr->nq);
+		for (i = 0; i < ctlr->nq; i++) {
+			snprint(qdir, sizeof qdir, "%squeue-%d/", dir, i);
+			vifqconnect(&ctlr->vq[i], qdir);
+		}
+	}
 	print("etherxen: request-rx-copy=%d\n", ctlr->rxcopy);
 	if (ctlr->rxcopy)
 		xenstore_setd(dir, "request-rx-copy", 1);
+	/* we take packets in several responses */
+	xenstore_setd(dir, "feature-sg", 1);
+	/* and with checksums left blank, which vifrecvdone marks as good */
+	xenstore_setd(dir, "feature-no-csum-offload", 0);
+	/*
+	 * not feature-ipv6-csum-offload: that would have IPv6 arrive
+	 * with blank checksums too, and the backend's key is only
+	 * used to gate offload on transmit
+	 */
 	xenstore_setd(dir, "state", XenbusStateConnected);
 	HYPERVISOR_yield();
 
@@ -368,13 +1197,24 @@ backendconnect(Ctlr *ctlr)
 	}
 }
 
+static int
+ringdepth(int n)
+{
+	if (n < XEN_NETIF_NR_SLOTS_MIN)
+		return XEN_NETIF_NR_SLOTS_MIN;
+	if (n > Nring)
+		return Nring;
+	return n;
+}
+
 static void
 etherxenattach(Ether *ether)
 {
 	Ctlr *ctlr;
+	Vifq *vq;
+	Rxbuf *rb;
 	char *p;
-	Txframe *tx;
-	int npage, i;
+	int npage, nbuf, i, j, g, c, m;
 
 	LOG(dprint("etherxenattach\n");)
 	ctlr = ether->ctlr;
@@ -384,32 +1224,89 @@ etherxenattach(Ether *ether)
 		return;
 	}
 
-	npage = 2 + Ntb + Nrb;
+	/*
+	 * each queue may hold a ref per transmit slot and per
+	 * receive buffer, and one per spare in the lending pool:
+	 * reserve that many, and if the table is short make the
+	 * rings, then the queues, fewer to fit
+	 */
+	m = ctlr->rxcopy ? 2 : 1;
+	c = ctlr->ntx + m*ctlr->nrx;
+	g = xengrantreserve(ctlr->nq*c);
+	if (ctlr->nq*c > g) {
+		ctlr->ntx = ringdepth(ctlr->ntx*g / (ctlr->nq*c));
+		ctlr->nrx = ringdepth(ctlr->nrx*g / (ctlr->nq*c));
+		c = ctlr->ntx + m*ctlr->nrx;
+		if (ctlr->nq*c > g)
+			ctlr->nq = g/c;
+		if (ctlr->nq < 1) {
+			xengrantreserve(-g);
+			qunlock(&ctlr->attachlock);
+			print("etherxen: vif %d: out of grant refs\n", ctlr->vifno);
+			error("out of grant refs");
+		}
+		print("etherxen: vif %d: %d queues, tx %d rx %d for want of grant refs\n",
+			ctlr->vifno, ctlr->nq, ctlr->ntx, ctlr->nrx);
+		xengrantreserve(ctlr->nq*c - g);
+	}
+
+	/* only pages shared for good can be lent out, as many as are posted */
+	nbuf = ctlr->nq * ctlr->nrx;
+	if (ctlr->rxcopy)
+		nbuf *= 2;
+	npage = 2*ctlr->nq + nbuf;
 	p = (char*)xspanalloc(npage<<PGSHIFT, BY2PG, 0);
-	p += ringinit(ctlr, p);
-	ctlr->txrefs = malloc(Ntb*sizeof(int));
-	ctlr->rxrefs = malloc(Nrb*sizeof(int));
-	ctlr->txframes = (Txframe*)p;
-	for (i = 0; i < Ntb; i++, p += BY2PG) {
-		tx = (Txframe*)p;
-		if (i != Ntb-1)
-			tx->tf.next = tx + 1;
-		else
-			tx->tf.next = 0;
-		ctlr->txrefs[i] = shareframe(ctlr->backend, tx, 0);
+	ctlr->vq = malloc(ctlr->nq*sizeof(Vifq));
+	for (i = 0; i < ctlr->nq; i++) {
+		vq = &ctlr->vq[i];
+		vq->ctlr = ctlr;
+		vq->qno = i;
+		p += ringinit(vq, p);
+		vq->txslots = malloc(ctlr->ntx*sizeof(Txslot));
+		for (j = 0; j < ctlr->ntx; j++) {
+			vq->txslots[j].next = vq->freetxslot;
+			vq->freetxslot = &vq->txslots[j];
+		}
+		vq->ntxfree = ctlr->ntx;
+		vq->rxslot = malloc(ctlr->nrx*sizeof(Rxbuf*));
+		if (ctlr->nq == 1)
+			vq->oq = ether->oq;
+		else if ((vq->oq = qopen(64*1024, Qmsg, 0, 0)) == nil)
+			panic("etherxen: qopen");
 	}
-	ctlr->freetxframe = ctlr->txframes;
-	ctlr->rxframes = (Rxframe*)p;
-	for (i = 0; i < Nrb; i++, p += BY2PG) {
+	ctlr->rxbufs = malloc(nbuf*sizeof(Rxbuf));
+	for (i = 0; i < nbuf; i++, p += BY2PG) {
+		rb = &ctlr->rxbufs[i];
+		rb->ctlr = ctlr;
+		rb->page = (Rxframe*)p;
 		if (ctlr->rxcopy)
-			ctlr->rxrefs[i] = shareframe(ctlr->backend, (Rxframe*)p, 1);
-		vifrecv(ctlr, (Rxframe*)p);
+			rb->ref = shareframe(ctlr->backend, p, 1);
+		if (i < ctlr->nq*ctlr->nrx) {
+			vq = &ctlr->vq[i / ctlr->nrx];
+			vq->rxslot[i % ctlr->nrx] = rb;
+			vifrecv(vq, i % ctlr->nrx);
+		} else {
+			rb->next = ctlr->rxpool;
+			ctlr->rxpool = rb;
+			ctlr->nrxpool++;
+		}
 	}
-	
-	ctlr->evtchn = xenchanalloc(ctlr->backend);
-	intrenable(ctlr->evtchn, etherxenintr, ether, BUSUNKNOWN, "vif");
 
-	kproc("vif", etherxenproc, ether);
+	for (i = 0; i < ctlr->nq; i++) {
+		vq = &ctlr->vq[i];
+		vq->txevtchn = xenchanalloc(ctlr->backend);
+		if (ctlr->split) {
+			vq->rxevtchn = xenchanalloc(ctlr->backend);
+			intrenable(vq->txevtchn, etherxentxintr, vq, BUSUNKNOWN, "vif tx");
+			intrenable(vq->rxevtchn, etherxenrxintr, vq, BUSUNKNOWN, "vif rx");
+		} else {
+			vq->rxevtchn = vq->txevtchn;
+			intrenable(vq->txevtchn, etherxenintr, vq, BUSUNKNOWN, "vif");
+		}
+		rxpush(vq);
+		kproc("vif", etherxenproc, vq);
+		kproc("vifrx", etherxenrxproc, vq);
+	}
 	backendconnect(ctlr);
 	ctlr->attached = 1;
 	qunlock(&ctlr->attachlock);
@@ -425,17 +1322,44 @@ static long
 ifstat(Ether* ether, void* a, long n, ulong offset)
 {
 	Ctlr *ctlr;
+	Vifq *vq;
 	char *buf, *p;
-	int l, len;
+	int l, len, i;
 
 	ctlr = ether->ctlr;
 	if(n == 0)
 		return 0;
 	if((p = malloc(READSTR)) == nil)
 		error(Enomem);
-	l = snprint(p, READSTR, "intr: %lud\n", ctlr->interrupts);
+	l = snprint(p, READSTR, "queues: %d\n", ctlr->nq);
+	/* transmit slots in use and receive buffers posted */
+	for (i = 0; ctlr->attached && i < ctlr->nq; i++) {
+		vq = &ctlr->vq[i];
+		l += snprint(p+l, READSTR-l, "queue %d: tx %d/%d rx %d/%d\n", i,
+			ctlr->ntx - vq->ntxfree, ctlr->ntx,
+			vq->rxring.req_prod_pvt - vq->rxring.rsp_cons, ctlr->nrx);
+	}
+	l += snprint(p+l, READSTR-l, "intr: %lud\n", ctlr->interrupts);
+	if (ctlr->split) {
+		l += snprint(p+l, READSTR-l, "txintr: %lud\n", ctlr->txinterrupts);
+		l += snprint(p+l, READSTR-l, "rxintr: %lud\n", ctlr->rxinterrupts);
+	}
+	l += snprint(p+l, READSTR-l, "rxpoll: %s budget %d\n",
+		ctlr->rxpoll ? "on" : "off", ctlr->rxbudget);
+	l += snprint(p+l, READSTR-l, "rxpolls: %lud\n", ctlr->rxpolls);
 	l += snprint(p+l, READSTR-l, "transmits: %lud\n", ctlr->transmits);
+	l += snprint(p+l, READSTR-l, "txpackets: %lud\n", ctlr->txpackets);
+	l += snprint(p+l, READSTR-l, "txbursts: %lud\n", ctlr->txbursts);
+	l += snprint(p+l, READSTR-l, "txnotifies: %lud\n", ctlr->txnotifies);
+	l += snprint(p+l, READSTR-l, "txfrags: %lud\n", ctlr->txfrags);
+	l += snprint(p+l, READSTR-l, "txcopies: %lud\n", ctlr->txcopies);
+	l += snprint(p+l, READSTR-l, "txcsum: %lud\n", ctlr->txcsum);
+	l += snprint(p+l, READSTR-l, "txgso: %lud\n", ctlr->txgso);
 	l += snprint(p+l, READSTR-l, "receives: %lud\n", ctlr->receives);
+	l += snprint(p+l, READSTR-l, "rxfrags: %lud\n", ctlr->rxfrags);
+	l += snprint(p+l, READSTR-l, "rxloans: %lud\n", ctlr->rxloans);
+	l += snprint(p+l, READSTR-l, "rxlro: %lud\n", ctlr->rxlro);
+	l += snprint(p+l, READSTR-l, "rxpool: %d\n", ctlr->nrxpool);
 	l += snprint(p+l, READSTR-l, "txerrors: %lud\n", ctlr->txerrors);
 	l += snprint(p+l, READSTR-l, "rxerrors: %lud\n", ctlr->rxerrors);
 	snprint(p+l, READSTR-l, "rxoverflows: %lud\n", ctlr->rxoverflows);
@@ -454,7 +1378,7 @@ pnp(Ether* ether)
 	char dir[64];
 	char buf[64];
 	Ctlr *ctlr;
-	int domid, rxcopy;
+	int domid, rxcopy, sg, ip6csum, nq, i;
 
 	if (nvif > Nvif)
 		return -1;
@@ -472,20 +1396,61 @@ pnp(Ether* ether)
 	rxcopy = 0;
 	if (xenstore_gets(dir, "feature-rx-copy", buf, sizeof buf) >= 0)
 		rxcopy = strtol(buf, 0, 0);
+	sg = 0;
+	if (xenstore_gets(dir, "feature-sg", buf, sizeof buf) > 0)
+		sg = strtol(buf, 0, 0);
+	ip6csum = 0;
+	if (xenstore_gets(dir, "feature-ipv6-csum-offload", buf, sizeof buf) > 0)
+		ip6csum = strtol(buf, 0, 0);
+	nq = 1;
+	if (xenstore_gets(dir, "multi-queue-max-queues", buf, sizeof buf) > 0)
+		nq = strtol(buf, 0, 0);
+	if (nq > Nqueue)
+		nq = Nqueue;
+	if (nq < 1)
+		nq = 1;
 	ether->ctlr = ctlr = malloc(sizeof(Ctlr));
 	memset(ctlr, 0, sizeof(Ctlr));
+	ctlr->ether = ether;
+	ctlr->nq = nq;
+	ctlr->ntx = Ntx;
+	ctlr->nrx = Nrb;
+	ctlr->rxpoll = 1;
+	ctlr->rxbudget = Rxbudget;
+	ctlr->lro = 1;
+	for (i = 0; i < ether->nopt; i++) {
+		if (cistrncmp(ether->opt[i], "tx=", 3) == 0)
+			ctlr->ntx = strtol(ether->opt[i]+3, 0, 0);
+		else if (cistrncmp(ether->opt[i], "rx=", 3) == 0)
+			ctlr->nrx = strtol(ether->opt[i]+3, 0, 0);
+	}
+	/* a packet may take XEN_NETIF_NR_SLOTS_MIN of either */
+	ctlr->ntx = ringdepth(ctlr->ntx);
+	ctlr->nrx = ringdepth(ctlr->nrx);
 	ctlr->backend = domid;
 	ctlr->vifno = nvif++;
 	ctlr->rxcopy = rxcopy;
+	ctlr->sg = sg;
+	ctlr->ip6csum = ip6csum;
+	if (xenstore_gets(dir, "feature-split-event-channels", buf, sizeof buf) > 0)
+		ctlr->split = strtol(buf, 0, 0);
+	/* super-segments span pages */
+	if (sg && xenstore_gets(dir, "feature-gso-tcpv4", buf, sizeof buf) > 0)
+		ctlr->gso4 = strtol(buf, 0, 0);
+	if (sg && xenstore_gets(dir, "feature-gso-tcpv6", buf, sizeof buf) > 0)
+		ctlr->gso6 = strtol(buf, 0, 0);
 
 	memmove(ether->ea, ea, sizeof ether->ea);
 	ether->mbps = 100;	// XXX what speed?
+	/* jumbo frames need the backend to take them in pieces */
+	if (sg)
+		ether->maxmtu = Maxmtu;
 	ether->attach = etherxenattach;
 	ether->detach = nil;
 	ether->transmit = etherxentransmit;
 	ether->irq = -1;
 	ether->tbdf = BUSUNKNOWN;
-	ether->interrupt = etherxenintr;
+	ether->interrupt = nil;	/* one per queue, enabled in attach */
 	ether->ifstat = ifstat;
 	ether->ctl = etherxenctl;
 	ether->promiscuous = nil;
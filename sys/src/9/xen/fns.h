@@ -132,7 +132,9 @@ void xentlbflush(void);
 int ffs(ulong);
 void xengrantinit(void);
 int xengrant(domid_t domid, ulong frame, int flags);
+int xengrantreserve(int n);
 int xengrantend(int ref);
+void* xenringalloc(domid_t domid, int order, int *refs);
 void acceptframe(int ref, void *va);
 int donateframe(int domid, void *va);
 int shareframe(int domid, void *va, int write);
@@ -144,6 +146,10 @@ void xenstore_write(char*, char*);
 void xenstore_setd(char *dir, char *node, int value);
 void xenstore_sets(char *dir, char *node, char * value);
 int xenstore_gets(char *dir, char *node, char *buf, int buflen);
+int xenstore_ls(char *dir, char *val, int len);
+void* xenstore_watch(char *dir, char *node);
+void xenstore_unwatch(void *w);
+int xenstore_waitwatch(void *w, ulong ms);
 int xenchanalloc(int);
 
 long HYPERVISOR_set_timer_op(uvlong timeout);
@@ -1,9 +1,10 @@
 /*
  * Xen block storage device frontend
  *
- * The present implementation follows the principle of
- * "what's the simplest thing that could possibly work?".
- * We can think about performance later.
+ * Transfers are split into blkif requests queued on the rings
+ * shared with the backend; a kproc per ring finishes them off
+ * as the backend answers, so any number of processes can have
+ * I/O outstanding on a disk.
  * We can think about dynamically attaching and removing devices later.
  */
 
@@ -35,64 +36,690 @@ enum {
 	MajorDevHDA	= 0x300,
 	MajorDevHDC	= 0x1600,
 	MajorDevXVD	= 0xCA00,
+
+	Sectshift	= 9,	/* blkif segments count 512-byte sectors */
+	Nseg		= BLKIF_MAX_SEGMENTS_PER_REQUEST,
+	Nindseg		= 64,	/* limit for BLKIF_OP_INDIRECT requests: 256K */
+	Npgrant		= 256,	/* limit of feature-persistent pool per queue: 1M */
+	Nqueue		= 4,	/* limit of multi-queue-num-queues */
+	Maxringorder	= 3,	/* limit of ring-page-order: 256 requests */
+	Ngrant		= 1024,	/* most grant refs one disk reserves */
+	Nrefreq		= 8,	/* full requests' data refs per queue, wanted */
+	Nlat		= 24,	/* log2 µs latency buckets, the last one up from 8s */
+	Rawindow	= 128,	/* default *sdxenra, Kbytes read ahead at a time */
+	Racache		= 1024,	/* default *sdxenracache, Kbytes of read-ahead buffers */
 };
 
 extern SDifc sdxenifc;
 
 typedef struct Ctlr Ctlr;
+typedef struct Vbdq Vbdq;
+typedef struct Vbdio Vbdio;
+typedef struct Vbdreq Vbdreq;
+typedef struct Pgrant Pgrant;
+typedef struct Rabuf Rabuf;
+
+static void vbdpush(Vbdq*);
+static void rainit(Ctlr*);
+
+/*
+ * One caller's transfer, split into as many ring requests
+ * as it takes and waited for as a whole.
+ */
+struct Vbdio {
+	int	pending;	/* ring requests still outstanding */
+	int	error;	/* BLKIF_RSP_ status of the first failure */
+	Rendez	done;
+};
+
+/*
+ * Page granted to the backend for good, which it keeps mapped
+ * when both ends agree on feature-persistent.
+ */
+struct Pgrant {
+	Pgrant	*next;
+	char	*page;
+	int	ref;
+};
+
+/*
+ * A window read ahead of a sequential reader: being filled
+ * while io.pending, and good unless io.error or stale.
+ */
+struct Rabuf {
+	char	*data;
+	uvlong	bno;
+	long	nb;	/* 0 if not in use */
+	Vbdq	*q;	/* of the last fill */
+	Vbdio	io;
+	QLock	wlk;	/* one reader at a time waits on io.done */
+	int	busy;	/* readers copying out, or being set up */
+	int	stale;	/* overwritten since */
+	ulong	used;
+};
+
+/*
+ * Ring request in flight; its index in Ctlr.req is the blkif request id.
+ */
+struct Vbdreq {
+	Vbdreq	*next;	/* free or done list */
+	Vbdio	*io;
+	int	status;	/* BLKIF_RSP_ from the backend */
+	int	nseg;
+	struct blkif_request_segment seg[Nindseg];
+	Pgrant	*pg[Nindseg];	/* persistent grants holding the data, if any */
+	struct blkif_request_segment *ind;	/* indirect segment page, if any */
+	int	indref;
+	char	*frame;	/* bounce page for unaligned buffers */
+	char	*data;	/* caller's buffer to fill on read completion */
+	long	len;
+	uvlong	ticks;	/* when put in the ring */
+
+	/* while held back for the elevator */
+	int	write;
+	uvlong	bno;
+	long	nb;
+	Vbdreq	*merged;	/* requests continuing this one on the ring */
+};
+
+/*
+ * One blkif ring with its own event channel and lock;
+ * a disk has as many as were negotiated with the backend.
+ */
+struct Vbdq {
+	Ctlr	*ctlr;
+	int	qno;
+	int	evtchn;
+	blkif_front_ring_t ring;
+	int	ringref[1<<Maxringorder];
+	Lock	ringlock;
+	int	nreq;
+	Vbdreq	*req;
+	Vbdreq	*freereq;
+	Rendez	wfreereq;
+	QLock	wreqlk;	/* one process at a time waits on wfreereq */
+	Pgrant	*freepg;	/* LIFO, to reuse pages still warm in the cache */
+	int	npg;
+	Rendez	wfreepg;
+	QLock	wpglk;	/* and on wfreepg */
+	int	nref;	/* data refs in flight, without persistent grants */
+	int	refneed;	/* what the waiter on wfreeref wants */
+	Rendez	wfreeref;
+	QLock	wreflk;	/* and on wfreeref */
+	Vbdreq	*donereq;	/* answered, waiting for vbdproc */
+	Vbdreq	*lastdone;
+	Rendez	wdone;
+
+	/* elevator: transfers not yet on the ring, sorted by bno */
+	Vbdreq	*pending;
+	int	npending;
+	uvlong	headpos;	/* where the last request sent ended */
+	int	hold;	/* keep transfers back while this many are on the ring */
+	ulong	merges;
+	ulong	sorts;
+
+	/* queue depth achieved, sampled at each submission */
+	int	inflight;
+	int	maxinflight;
+	ulong	submits;
+	uvlong	depthsum;
+	uvlong	segsum;
+	ulong	lat[Nlat];	/* backend: ring submission to response */
+};
 
 struct Ctlr {
+	Ctlr	*next;	/* in vbds */
+	int	ready;	/* connected to the backend, or -1 if it failed */
+	Rendez	wready;
 	int	online;
 	ulong	secsize;
-	ulong	sectors;
+	ulong	physsize;	/* physical-sector-size, to align requests to */
+	ulong	spb;	/* 512-byte blkif sectors per block */
+	ulong	framesize;	/* of a bounce frame: a page, or a sector */
+	uvlong	sectors;
 	int	backend;
 	int	devid;
-	int	evtchn;
-	blkif_front_ring_t ring;
-	int	ringref;
-	Lock	ringlock;
-	char	*frame;
-	QLock	iolock;
-	int	iodone;
-	Rendez	wiodone;
+	int	maxseg;	/* segments per request, > Nseg if indirect */
+	int	persistent;
+	int	maxref;	/* data refs per queue: persistent pool, or in flight */
+	int	ringorder;
+	int	nq;
+	Vbdq	q[Nqueue];
+	int	flush;	/* feature-flush-cache */
+	int	barrier;	/* feature-barrier */
+	int	discard;	/* feature-discard */
+	int	writethrough;	/* flush after every write */
+
+	/* transfers by the way the data reaches the backend */
+	ulong	aligned;	/* granted in place */
+	ulong	bounced;	/* through bounce pages */
+	ulong	copied;	/* through persistent grants */
+
+	ulong	reads;
+	ulong	writes;
+	uvlong	rbytes;
+	uvlong	wbytes;
+	ulong	errors;
+	ulong	grants;	/* grant refs allocated for data */
+	ulong	lat[Nlat];	/* whole transfers, as the caller waits */
+
+	/* read-ahead */
+	Lock	ralock;
+	Rabuf	*ra;
+	int	nra;
+	long	rawindow;	/* blocks */
+	uvlong	ranext;	/* where a sequential read would go on */
+	uvlong	rahead;	/* where the last window read ahead ends */
+	ulong	raclock;
+	ulong	rahits;
+	ulong	ramisses;
+	ulong	raprefetches;
 };
 
-static int
-ringinit(Ctlr *ctlr, char *a)
+static void
+ringinit(Vbdq *q)
 {
 	blkif_sring_t *sr;
+	int order;
 
-	sr = (blkif_sring_t*)a;
-	memset(sr, 0, BY2PG);
+	order = q->ctlr->ringorder;
+	sr = xenringalloc(q->ctlr->backend, order, q->ringref);
 	SHARED_RING_INIT(sr);
-	FRONT_RING_INIT(&ctlr->ring, sr, BY2PG);
-	ctlr->ringref = shareframe(ctlr->backend, sr, 1);
-	return BY2PG;
+	FRONT_RING_INIT(&q->ring, sr, BY2PG<<order);
+}
+
+/*
+ * n request slots for the ring, each with a bounce page unless
+ * persistent grants make it unnecessary, and an indirect segment
+ * page, granted once and for all, if requests can carry more than
+ * Nseg segments
+ */
+static void
+reqinit(Vbdq *q, int n)
+{
+	Ctlr *ctlr;
+	Vbdreq *r;
+	char *p, *ip;
+	int i;
+
+	ctlr = q->ctlr;
+	q->nreq = n;
+	q->hold = n - n/4;
+	q->req = mallocz(n*sizeof(Vbdreq), 1);
+	p = ip = nil;
+	if (!ctlr->persistent)
+		p = xspanalloc(n*ctlr->framesize, BY2PG, 0);
+	if (ctlr->maxseg > Nseg)
+		ip = xspanalloc(n*BY2PG, BY2PG, 0);
+	if (q->req == nil || !ctlr->persistent && p == nil || ctlr->maxseg > Nseg && ip == nil)
+		panic("sdxen: no memory for requests");
+	for (i = n-1; i >= 0; i--) {
+		r = &q->req[i];
+		if (p != nil)
+			r->frame = p + i*ctlr->framesize;
+		if (ip != nil) {
+			r->ind = (struct blkif_request_segment*)(ip + i*BY2PG);
+			/* persistent grants are mapped writable, whatever they hold */
+			r->indref = shareframe(ctlr->backend, r->ind, ctlr->persistent);
+		}
+		r->next = q->freereq;
+		q->freereq = r;
+	}
 }
 
 static int
-vbdsend(Ctlr *ctlr, int write, int ref, int nb, uvlong bno)
+wfreereq(void *a)
+{
+	return ((Vbdq*)a)->freereq != nil;
+}
+
+static int
+wfreepg(void *a)
+{
+	return ((Vbdq*)a)->freepg != nil;
+}
+
+static int
+wfreeref(void *a)
+{
+	Vbdq *q = a;
+
+	return q->nref + q->refneed <= q->ctlr->maxref;
+}
+
+/*
+ * count n refs for a request's data against the queue's share,
+ * waiting for answers to give some back if need be
+ */
+static void
+refget(Vbdq *q, int n)
+{
+	ilock(&q->ringlock);
+	if (q->nref + n <= q->ctlr->maxref) {
+		q->nref += n;
+		iunlock(&q->ringlock);
+		return;
+	}
+	iunlock(&q->ringlock);
+	vbdpush(q);
+	qlock(&q->wreflk);
+	q->refneed = n;
+	for (;;) {
+		while (waserror())
+			;
+		sleep(&q->wfreeref, wfreeref, q);
+		poperror();
+		ilock(&q->ringlock);
+		if (q->nref + n <= q->ctlr->maxref) {
+			q->nref += n;
+			iunlock(&q->ringlock);
+			break;
+		}
+		iunlock(&q->ringlock);
+	}
+	q->refneed = 0;
+	qunlock(&q->wreflk);
+}
+
+static Vbdreq*
+reqalloc(Vbdq *q)
+{
+	Vbdreq *r;
+
+	for (;;) {
+		ilock(&q->ringlock);
+		if ((r = q->freereq) != nil) {
+			q->freereq = r->next;
+			iunlock(&q->ringlock);
+			r->next = nil;
+			r->merged = nil;
+			r->data = nil;
+			r->nseg = 0;
+			return r;
+		}
+		iunlock(&q->ringlock);
+		/* ring is full: let the backend see what is queued, and wait */
+		vbdpush(q);
+		qlock(&q->wreqlk);
+		while (waserror())
+			;
+		sleep(&q->wfreereq, wfreereq, q);
+		poperror();
+		qunlock(&q->wreqlk);
+	}
+}
+
+/*
+ * grant the pages under buf to the backend, one segment per page,
+ * until len bytes or maxseg segments are covered;
+ * returns the number of bytes covered
+ */
+static long
+vbdsegs(Vbdq *q, Vbdreq *r, char *buf, long len, int write, int maxseg)
+{
+	struct blkif_request_segment *sg;
+	long off, n, done;
+
+	for (done = 0; done < len && r->nseg < maxseg; done += n) {
+		off = PGOFF((ulong)buf);
+		n = BY2PG - off;
+		if (n > len - done)
+			n = len - done;
+		sg = &r->seg[r->nseg++];
+		sg->gref = shareframe(q->ctlr->backend, buf, !write);
+		q->ctlr->grants++;
+		sg->first_sect = off>>Sectshift;
+		sg->last_sect = ((off+n)>>Sectshift) - 1;
+		buf += n;
+	}
+	return done;
+}
+
+static void
+pgfree(Vbdq *q, Pgrant *pg)
+{
+	ilock(&q->ringlock);
+	pg->next = q->freepg;
+	if (q->freepg == nil)
+		wakeup(&q->wfreepg);
+	q->freepg = pg;
+	iunlock(&q->ringlock);
+}
+
+/*
+ * take a page from the persistent grant pool, growing it
+ * up to ctlr->maxref pages; nil if the pool is exhausted
+ */
+static Pgrant*
+pgalloc(Vbdq *q)
+{
+	Pgrant *pg;
+
+	ilock(&q->ringlock);
+	if ((pg = q->freepg) != nil) {
+		q->freepg = pg->next;
+		iunlock(&q->ringlock);
+		return pg;
+	}
+	if (q->npg >= q->ctlr->maxref) {
+		iunlock(&q->ringlock);
+		return nil;
+	}
+	q->npg++;
+	iunlock(&q->ringlock);
+	pg = malloc(sizeof(Pgrant));
+	if (pg == nil || (pg->page = mallocalign(BY2PG, BY2PG, 0, 0)) == nil)
+		panic("sdxen: no memory for persistent grants");
+	pg->ref = shareframe(q->ctlr->backend, pg->page, 1);
+	q->ctlr->grants++;
+	return pg;
+}
+
+/*
+ * with persistent grants the data is copied through pages from
+ * the pool rather than granting the caller's buffer;
+ * stops early if the pool runs dry, returning the bytes covered
+ */
+static long
+vbdpsegs(Vbdq *q, Vbdreq *r, char *data, long len, int write, int maxseg)
+{
+	struct blkif_request_segment *sg;
+	Pgrant *pg;
+	long n, done;
+
+	for (done = 0; done < len && r->nseg < maxseg; done += n) {
+		if ((pg = pgalloc(q)) == nil)
+			break;
+		n = BY2PG;
+		if (n > len - done)
+			n = len - done;
+		if (write)
+			memmove(pg->page, data+done, n);
+		r->pg[r->nseg] = pg;
+		sg = &r->seg[r->nseg++];
+		sg->gref = pg->ref;
+		sg->first_sect = 0;
+		sg->last_sect = (n>>Sectshift) - 1;
+	}
+	/* with sectors bigger than a page, give back the pages of a partial one */
+	while (done % q->ctlr->secsize) {
+		pg = r->pg[--r->nseg];
+		r->pg[r->nseg] = nil;
+		done -= (r->seg[r->nseg].last_sect+1)<<Sectshift;
+		pgfree(q, pg);
+	}
+	return done;
+}
+
+/*
+ * count the time since ticks in a log2 µs histogram
+ */
+static void
+latency(ulong *lat, uvlong ticks)
+{
+	uvlong us;
+	int i;
+
+	us = fastticks2us(fastticks(nil) - ticks);
+	for (i = 0; i < Nlat-1 && us > 1; i++)
+		us >>= 1;
+	lat[i]++;
+}
+
+/*
+ * account for a request just put in the ring at req_prod_pvt;
+ * called with ringlock held
+ */
+static void
+vbdqueued(Vbdq *q, int nseg)
+{
+	q->ring.req_prod_pvt++;
+	if (++q->inflight > q->maxinflight)
+		q->maxinflight = q->inflight;
+	q->submits++;
+	q->depthsum += q->inflight;
+	q->segsum += nseg;
+}
+
+/*
+ * put r and the requests merged behind it, nseg segments
+ * in all, in the ring as one request; called with ringlock held.
+ * Requests with more than Nseg segments carry their
+ * segment list in the first one's indirect page.
+ */
+static void
+vbdring(Vbdq *q, Vbdreq *r, int nseg)
 {
 	blkif_request_t *req;
-	int i, notify;
+	blkif_request_indirect_t *ireq;
+	struct blkif_request_segment *sg;
+	Vbdreq *m;
 
-	ilock(&ctlr->ringlock);		// XXX conservative
-	i = ctlr->ring.req_prod_pvt;
-	req = RING_GET_REQUEST(&ctlr->ring, i);	// XXX overflow?
+	req = RING_GET_REQUEST(&q->ring, q->ring.req_prod_pvt);
+	if (nseg > Nseg) {
+		ireq = (blkif_request_indirect_t*)req;
+		ireq->operation = BLKIF_OP_INDIRECT;
+		ireq->indirect_op = r->write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+		ireq->nr_segments = nseg;
+		ireq->handle = q->ctlr->devid;
+		ireq->id = r - q->req;
+		ireq->sector_number = r->bno * q->ctlr->spb;
+		ireq->indirect_grefs[0] = r->indref;
+		sg = r->ind;
+	} else {
+		req->operation = r->write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+		req->nr_segments = nseg;
+		req->handle = q->ctlr->devid;
+		req->id = r - q->req;
+		req->sector_number = r->bno * q->ctlr->spb;
+		sg = req->seg;
+	}
+	for (m = r; m != nil; m = m->merged) {
+		memmove(sg, m->seg, m->nseg*sizeof(m->seg[0]));
+		sg += m->nseg;
+	}
+	r->ticks = fastticks(nil);
+	vbdqueued(q, nseg);
+}
 
-	req->operation = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
-	req->nr_segments = 1;
-	req->handle = ctlr->devid;
-	req->id = 1;
-	req->sector_number = bno;
-	req->seg[0].gref = ref;
-	req->seg[0].first_sect = 0;
-	req->seg[0].last_sect = nb-1;
+/*
+ * hand a transfer of nb sectors at bno to the elevator,
+ * which keeps pending transfers sorted by bno
+ */
+static void
+vbdsend(Vbdq *q, Vbdreq *r, int write, uvlong bno, long nb)
+{
+	Vbdreq **l;
 
-	ctlr->ring.req_prod_pvt = i+1;
-	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&ctlr->ring, notify);
-	iunlock(&ctlr->ringlock);
-	return notify;
+	r->write = write;
+	r->bno = bno;
+	r->nb = nb;
+	r->merged = nil;
+	ilock(&q->ringlock);
+	r->io->pending++;
+	for (l = &q->pending; *l != nil && (*l)->bno <= bno; l = &(*l)->next)
+		;
+	if (*l != nil)
+		q->sorts++;
+	r->next = *l;
+	*l = r;
+	q->npending++;
+	iunlock(&q->ringlock);
+}
+
+/*
+ * move pending transfers to the ring in one sweep up the disk
+ * from where the last one ended (C-LOOK), merging each with
+ * those continuing it as far as maxseg allows, then push them
+ * to the backend, kicking it if it asks for that.
+ * While q->hold requests are on the ring anyway, transfers
+ * are kept back to merge with later ones; vbdproc sends
+ * them as the backend answers.
+ */
+static void
+vbdpush(Vbdq *q)
+{
+	Vbdreq *r, *m, *last, **l;
+	int nseg, notify;
+
+	ilock(&q->ringlock);
+	while (q->pending != nil && q->inflight < q->hold) {
+		for (l = &q->pending; *l != nil && (*l)->bno < q->headpos; l = &(*l)->next)
+			;
+		if (*l == nil)
+			l = &q->pending;
+		r = *l;
+		*l = r->next;
+		q->npending--;
+		nseg = r->nseg;
+		for (last = r; (m = *l) != nil; last = m) {
+			if (m->write != r->write || m->bno != last->bno + last->nb
+			|| nseg + m->nseg > q->ctlr->maxseg)
+				break;
+			*l = m->next;
+			q->npending--;
+			last->merged = m;
+			nseg += m->nseg;
+			q->merges++;
+		}
+		q->headpos = last->bno + last->nb;
+		vbdring(q, r, nseg);
+	}
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&q->ring, notify);
+	iunlock(&q->ringlock);
+	if (notify)
+		xenchannotify(q->evtchn);
+}
+
+/*
+ * queue a request without data: a cache flush, a barrier,
+ * or a discard of nb blocks from bno
+ */
+static void
+vbdsendop(Vbdq *q, Vbdreq *r, int op, uvlong bno, uvlong nb)
+{
+	blkif_request_t *req;
+	blkif_request_discard_t *dreq;
+	int i;
+
+	ilock(&q->ringlock);
+	i = q->ring.req_prod_pvt;
+	req = RING_GET_REQUEST(&q->ring, i);
+	if (op == BLKIF_OP_DISCARD) {
+		dreq = (blkif_request_discard_t*)req;
+		dreq->operation = op;
+		dreq->flag = 0;
+		dreq->handle = q->ctlr->devid;
+		dreq->id = r - q->req;
+		dreq->sector_number = bno * q->ctlr->spb;
+		dreq->nr_sectors = nb * q->ctlr->spb;
+	} else {
+		req->operation = op;
+		req->nr_segments = 0;
+		req->handle = q->ctlr->devid;
+		req->id = r - q->req;
+		req->sector_number = 0;
+	}
+	r->io->pending++;
+	r->ticks = fastticks(nil);
+	vbdqueued(q, 0);
+	iunlock(&q->ringlock);
+}
+
+/*
+ * finish an answered request in vbdproc: copy read data out of
+ * persistent or bounce pages, release grants, pages and slot,
+ * and wake the caller when its whole transfer is done
+ */
+static void
+vbddone(Vbdq *q, Vbdreq *r)
+{
+	Vbdio *io;
+	Pgrant *pg;
+	char *data;
+	long n;
+	int i, status;
+
+	io = r->io;
+	status = r->status;
+	if (r->pg[0] != nil) {
+		data = r->data;
+		if (data != nil && status == BLKIF_RSP_OKAY)
+			for (i = 0; i < r->nseg; i++) {
+				n = (r->seg[i].last_sect+1)<<Sectshift;
+				memmove(data, r->pg[i]->page, n);
+				data += n;
+			}
+	} else {
+		for (i = 0; i < r->nseg; i++)
+			xengrantend(r->seg[i].gref);
+		if (r->data != nil && status == BLKIF_RSP_OKAY)
+			memmove(r->data, r->frame, r->len);
+	}
+
+	ilock(&q->ringlock);
+	if (status != BLKIF_RSP_OKAY && io->error == BLKIF_RSP_OKAY)
+		io->error = status;
+	if (r->pg[0] == nil && r->nseg > 0) {
+		q->nref -= r->nseg;
+		if (q->refneed)
+			wakeup(&q->wfreeref);
+	}
+	for (i = 0; i < r->nseg && r->pg[i] != nil; i++) {
+		pg = r->pg[i];
+		r->pg[i] = nil;
+		pg->next = q->freepg;
+		if (q->freepg == nil)
+			wakeup(&q->wfreepg);
+		q->freepg = pg;
+	}
+	r->io = nil;
+	r->next = q->freereq;
+	if (q->freereq == nil)
+		wakeup(&q->wfreereq);
+	q->freereq = r;
+	/* wake the caller before ringlock is released: see xenbio */
+	if (--io->pending == 0)
+		wakeup(&io->done);
+	iunlock(&q->ringlock);
+}
+
+static int
+wdone(void *a)
+{
+	return ((Vbdq*)a)->donereq != nil;
+}
+
+/*
+ * completion process for a ring, keeping copies and grant
+ * table work out of the interrupt handler
+ */
+static void
+vbdproc(void *a)
+{
+	Vbdq *q = a;
+	Vbdreq *r, *m, *next;
+	int status;
+
+	for (;;) {
+		sleep(&q->wdone, wdone, q);
+		ilock(&q->ringlock);
+		r = q->donereq;
+		q->donereq = nil;
+		iunlock(&q->ringlock);
+		for (; r != nil; r = next) {
+			next = r->next;
+			/* the backend answered for those merged with r too */
+			status = r->status;
+			for (; r != nil; r = m) {
+				m = r->merged;
+				r->status = status;
+				vbddone(q, r);
+			}
+		}
+		/* the ring has room for anything held back */
+		vbdpush(q);
+	}
 }
 
 static void
@@ -100,27 +727,83 @@ backendconnect(Ctlr *ctlr)
 {
 	char dir[64];
 	char buf[64];
+	char node[32];
+	char *qdir;
+	Vbdq *q;
+	void *w;
+	int i, j;
 
 	sprint(dir, "device/vbd/%d/", ctlr->devid);
-	xenstore_setd(dir, "ring-ref", ctlr->ringref);
-	xenstore_setd(dir, "event-channel", ctlr->evtchn);
+	if (ctlr->nq > 1)
+		xenstore_setd(dir, "multi-queue-num-queues", ctlr->nq);
+	if (ctlr->ringorder > 0)
+		xenstore_setd(dir, "ring-page-order", ctlr->ringorder);
+	for (i = 0; i < ctlr->nq; i++) {
+		q = &ctlr->q[i];
+		qdir = node;
+		if (ctlr->nq > 1)
+			qdir += sprint(node, "queue-%d/", i);
+		if (ctlr->ringorder == 0) {
+			strcpy(qdir, "ring-ref");
+			xenstore_setd(dir, node, q->ringref[0]);
+		} else {
+			for (j = 0; j < 1<<ctlr->ringorder; j++) {
+				sprint(qdir, "ring-ref%d", j);
+				xenstore_setd(dir, node, q->ringref[j]);
+			}
+		}
+		strcpy(qdir, "event-channel");
+		xenstore_setd(dir, node, q->evtchn);
+	}
+	xenstore_setd(dir, "feature-persistent", 1);
 	xenstore_setd(dir, "state", XenbusStateInitialised);
 	xenstore_gets(dir, "backend", buf, sizeof buf);
 	sprint(dir, "%s/", buf);
-	HYPERVISOR_yield();
-	xenstore_gets(dir, "state", buf, sizeof buf);
-	while (strtol(buf, 0, 0) != XenbusStateConnected) {
-		print("sdxen: waiting for vbd %d to connect\n", ctlr->devid);
-		tsleep(&up->sleep, return0, 0, 50);
-		xenstore_gets(dir, "state", buf, sizeof buf);
-	}
+	/* the watch wakes us as the backend changes state */
+	w = xenstore_watch(dir, "state");
+	while (xenstore_gets(dir, "state", buf, sizeof buf) <= 0
+	|| strtol(buf, 0, 0) != XenbusStateConnected)
+		if (!xenstore_waitwatch(w, 5000))
+			print("sdxen: waiting for vbd %d to connect\n", ctlr->devid);
+	xenstore_unwatch(w);
+	/*
+	 * the ring and the sectors node count 512-byte sectors
+	 * whatever the logical sector size
+	 */
 	xenstore_gets(dir, "sector-size", buf, sizeof buf);
-	ctlr->secsize = strtol(buf, 0, 0);
+	ctlr->secsize = strtoul(buf, 0, 0);
+	if (ctlr->secsize < 1<<Sectshift || ctlr->secsize & (ctlr->secsize-1)
+	|| ctlr->secsize > Nseg*BY2PG)
+		panic("sdxen: vbd %d: bad sector size %lud", ctlr->devid, ctlr->secsize);
+	ctlr->spb = ctlr->secsize>>Sectshift;
+	ctlr->framesize = ROUNDUP(ctlr->secsize, BY2PG);
+	ctlr->physsize = ctlr->secsize;
+	if (xenstore_gets(dir, "physical-sector-size", buf, sizeof buf) > 0)
+		ctlr->physsize = strtoul(buf, 0, 0);
+	if (ctlr->physsize < ctlr->secsize || ctlr->physsize & (ctlr->physsize-1))
+		ctlr->physsize = ctlr->secsize;
 	xenstore_gets(dir, "sectors", buf, sizeof buf);
-	ctlr->sectors = strtol(buf, 0, 0);
-	print("sdxen: backend %s secsize %ld sectors %ld\n", dir, ctlr->secsize, ctlr->sectors);
-	if (ctlr->secsize > BY2PG)
-		panic("sdxen: sector size bigger than mmu page size");
+	ctlr->sectors = strtoull(buf, 0, 0) / ctlr->spb;
+	print("sdxen: backend %s secsize %lud physical %lud sectors %llud\n",
+		dir, ctlr->secsize, ctlr->physsize, ctlr->sectors);
+	ctlr->maxseg = Nseg;
+	if (xenstore_gets(dir, "feature-max-indirect-segments", buf, sizeof buf) > 0) {
+		ctlr->maxseg = strtol(buf, 0, 0);
+		if (ctlr->maxseg > Nindseg)
+			ctlr->maxseg = Nindseg;
+		if (ctlr->maxseg > Nseg)
+			print("sdxen: vbd %d: %d indirect segments\n", ctlr->devid, ctlr->maxseg);
+		else
+			ctlr->maxseg = Nseg;
+	}
+	if (xenstore_gets(dir, "feature-persistent", buf, sizeof buf) > 0)
+		ctlr->persistent = strtol(buf, 0, 0);
+	if (xenstore_gets(dir, "feature-flush-cache", buf, sizeof buf) > 0)
+		ctlr->flush = strtol(buf, 0, 0);
+	if (xenstore_gets(dir, "feature-barrier", buf, sizeof buf) > 0)
+		ctlr->barrier = strtol(buf, 0, 0);
+	if (xenstore_gets(dir, "feature-discard", buf, sizeof buf) > 0)
+		ctlr->discard = strtol(buf, 0, 0);
 }
 
 static void
@@ -132,72 +815,211 @@ backendactivate(Ctlr *ctlr)
 	xenstore_setd(dir, "state", XenbusStateConnected);
 }
 
-static SDev*
-xenpnp(void)
+/*
+ * Linux device numbers of the disks in each of our SDevs
+ */
+static struct {
+	char	idno;
+	int	major;
+	int	stride;	/* from one disk to the next */
+	int	nunit;
+} vbdnames[Ndevs] = {
+	'0',	MajorDevSD,	16,	8,
+	'C',	MajorDevHDA,	64,	2,
+	'D',	MajorDevHDC,	64,	2,
+	'E',	MajorDevXVD,	16,	8,
+};
+
+static Ctlr *vbds;	/* all the disks xenpnp found */
+static Lock vbdlock;
+static int vbdstarted;
+
+/*
+ * the SDev and unit a Linux device number stands for
+ */
+static int
+linuxunit(int devid, int *subno)
 {
-	SDev *sdev[Ndevs];
-	static char idno[Ndevs] = { '0', 'C', 'D', 'E' };
-	static char nunit[Ndevs] = { 8, 2, 2, 8 };
-	int i;
+	int i, n;
 
 	for (i = 0; i < Ndevs; i++) {
-		sdev[i] = mallocz(sizeof(SDev), 1);
-		sdev[i]->ifc = &sdxenifc;
-		sdev[i]->idno = idno[i];
-		sdev[i]->nunit = nunit[i];
-		sdev[i]->ctlr = (Ctlr**)mallocz(sdev[i]->nunit*sizeof(Ctlr*), 1);
-		if (i > 0)
-			sdev[i]->next = sdev[i-1];
+		n = devid - vbdnames[i].major;
+		if (n >= 0 && n%vbdnames[i].stride == 0 && n/vbdnames[i].stride < vbdnames[i].nunit) {
+			*subno = n/vbdnames[i].stride;
+			return i;
+		}
 	}
-	return sdev[Ndevs-1];
+	return -1;
 }
 
-static int
-linuxdev(int idno, int subno)
-{
-	switch (idno) {
-	case '0':
-		return MajorDevSD + 16*subno;
-	case 'C':
-		return MajorDevHDA + 64*subno;
-	case 'D':
-		return MajorDevHDC + 64*subno;
-	case 'E':
-		return MajorDevXVD + 16*subno;
-	default:
-		return 0;
+/*
+ * one directory read of device/vbd finds all the disks,
+ * and only SDevs with disks are made
+ */
+static SDev*
+xenpnp(void)
+{
+	SDev *sdev[Ndevs], *head;
+	Ctlr *ctlr;
+	char names[512], *p;
+	int i, n, devid, subno;
+
+	n = xenstore_ls("device/vbd", names, sizeof names);
+	if (n <= 0)
+		return nil;
+	memset(sdev, 0, sizeof sdev);
+	for (p = names; n-- > 0; p += strlen(p)+1) {
+		devid = strtol(p, 0, 0);
+		if ((i = linuxunit(devid, &subno)) < 0) {
+			print("sdxen: vbd %d: no unit to put it in\n", devid);
+			continue;
+		}
+		if (sdev[i] == nil) {
+			sdev[i] = mallocz(sizeof(SDev), 1);
+			sdev[i]->ifc = &sdxenifc;
+			sdev[i]->idno = vbdnames[i].idno;
+			sdev[i]->nunit = vbdnames[i].nunit;
+			sdev[i]->ctlr = (Ctlr**)mallocz(sdev[i]->nunit*sizeof(Ctlr*), 1);
+		}
+		ctlr = mallocz(sizeof(Ctlr), 1);
+		ctlr->devid = devid;
+		((Ctlr**)sdev[i]->ctlr)[subno] = ctlr;
+		ctlr->next = vbds;
+		vbds = ctlr;
 	}
+	head = nil;
+	for (i = 0; i < Ndevs; i++)
+		if (sdev[i] != nil) {
+			sdev[i]->next = head;
+			head = sdev[i];
+		}
+	return head;
 }
 
-static int
-xenverify(SDunit *unit)
+/*
+ * set up a disk's rings and connect it to its backend;
+ * the disks all do this at once, each in a kproc of its own
+ */
+static void
+vbdconnect(void *a)
 {
 	Ctlr *ctlr;
+	Vbdq *q;
 	char dir[64];
 	char buf[64];
-	int devid;
-	int npage;
-	char *p;
-
-	if (unit->subno > unit->dev->nunit)
-		return 0;
-	devid = linuxdev(unit->dev->idno, unit->subno);
-	sprint(dir, "device/vbd/%d/", devid);
-	if (xenstore_gets(dir, "backend-id", buf, sizeof buf) <= 0)
-		return 0;
+	int i, n, g, c, d, ind;
 
-	ctlr = mallocz(sizeof(Ctlr), 1);
-	((Ctlr**)unit->dev->ctlr)[unit->subno] = ctlr;
-	ctlr->devid = devid;
+	ctlr = a;
+	sprint(dir, "device/vbd/%d/", ctlr->devid);
+	if (xenstore_gets(dir, "backend-id", buf, sizeof buf) <= 0) {
+		ctlr->ready = -1;
+		wakeup(&ctlr->wready);
+		pexit("", 1);
+	}
 	ctlr->backend = strtol(buf, 0, 0);
 
-	npage = 2;
-	p = xspanalloc(npage<<PGSHIFT, BY2PG, 0);
-	p += ringinit(ctlr, p);
-	ctlr->frame = p;
-	ctlr->evtchn = xenchanalloc(ctlr->backend);
+	/* the backend offers multiple queues and bigger rings before it connects */
+	ctlr->nq = 1;
+	if (xenstore_gets(dir, "backend", buf, sizeof buf) > 0) {
+		sprint(dir, "%s/", buf);
+		if (xenstore_gets(dir, "multi-queue-max-queues", buf, sizeof buf) > 0)
+			ctlr->nq = strtol(buf, 0, 0);
+		if (ctlr->nq > Nqueue)
+			ctlr->nq = Nqueue;
+		if (ctlr->nq < 1)
+			ctlr->nq = 1;
+		if (xenstore_gets(dir, "max-ring-page-order", buf, sizeof buf) > 0)
+			ctlr->ringorder = strtol(buf, 0, 0);
+		if (ctlr->ringorder > Maxringorder)
+			ctlr->ringorder = Maxringorder;
+		if (ctlr->ringorder < 0)
+			ctlr->ringorder = 0;
+	}
+
+	for (i = 0; i < ctlr->nq; i++) {
+		q = &ctlr->q[i];
+		q->ctlr = ctlr;
+		q->qno = i;
+		ringinit(q);
+		q->evtchn = xenchanalloc(ctlr->backend);
+	}
 	backendconnect(ctlr);
 
+	/*
+	 * Reserve the grant refs the disk will use, up to Ngrant:
+	 * each request holds one for its indirect segment page,
+	 * and a queue's data takes Nrefreq full requests' worth,
+	 * as persistent pool or counted by refget in flight.
+	 * With less, give half to indirect pages and the rest to
+	 * data, using fewer ring entries than there are.
+	 */
+	ind = ctlr->maxseg > Nseg;
+	n = RING_SIZE(&ctlr->q[0].ring);
+	d = Nrefreq*ctlr->maxseg;
+	if (ctlr->persistent && d > Npgrant)
+		d = Npgrant;
+	/* a request in flight takes some data refs too */
+	if (ind && n > d)
+		n = d;
+	g = ctlr->nq*(n*ind + d);
+	if (g > Ngrant)
+		g = Ngrant;
+	g = xengrantreserve(g);
+	c = g / ctlr->nq;
+	if (n*ind + d > c) {
+		if (ind && n > c/2)
+			n = c/2;
+		d = c - n*ind;
+	}
+	ctlr->maxref = d;
+	if (n < 1 || d < ctlr->maxseg) {
+		xengrantreserve(-g);
+		print("sdxen: vbd %d: out of grant refs\n", ctlr->devid);
+		ctlr->ready = -1;
+		wakeup(&ctlr->wready);
+		pexit("", 1);
+	}
+	for (i = 0; i < ctlr->nq; i++)
+		reqinit(&ctlr->q[i], n);
+	rainit(ctlr);
+
+	ctlr->ready = 1;
+	wakeup(&ctlr->wready);
+	pexit("", 1);
+}
+
+static int
+isready(void *a)
+{
+	return ((Ctlr*)a)->ready != 0;
+}
+
+static int
+xenverify(SDunit *unit)
+{
+	Ctlr *ctlr, *c;
+	char name[KNAMELEN];
+
+	if (unit->subno >= unit->dev->nunit)
+		return 0;
+	ctlr = ((Ctlr**)unit->dev->ctlr)[unit->subno];
+	if (ctlr == nil)
+		return 0;
+	/* the first disk looked at starts them all connecting */
+	lock(&vbdlock);
+	if (!vbdstarted) {
+		vbdstarted = 1;
+		unlock(&vbdlock);
+		for (c = vbds; c != nil; c = c->next) {
+			snprint(name, sizeof name, "vbdconnect%d", c->devid);
+			kproc(name, vbdconnect, c);
+		}
+	} else
+		unlock(&vbdlock);
+	sleep(&ctlr->wready, isready, ctlr);
+	if (ctlr->ready < 0)
+		return 0;
+
 	unit->inquiry[0] = 0;		// XXX how do we know if it's a CD?
 	unit->inquiry[2] = 2;
 	unit->inquiry[3] = 2;
@@ -210,49 +1032,62 @@ xenverify(SDunit *unit)
 static int
 wiodone(void *a)
 {
-	return ((Ctlr*)a)->iodone != 0;
+	return ((Vbdio*)a)->pending == 0;
 }
 
 static void
 sdxenintr(Ureg *, void *a)
 {
-	Ctlr *ctlr = a;
+	Vbdq *q = a;
 	blkif_response_t *rsp;
-	int i, avail;
+	Vbdreq *r;
+	int i, avail, done;
 
-	ilock(&ctlr->ringlock);	// XXX conservative
+	done = 0;
+	ilock(&q->ringlock);
 	for (;;) {
-		RING_FINAL_CHECK_FOR_RESPONSES(&ctlr->ring, avail);
+		RING_FINAL_CHECK_FOR_RESPONSES(&q->ring, avail);
 		if (!avail)
 			break;
-		i = ctlr->ring.rsp_cons;
-		rsp = RING_GET_RESPONSE(&ctlr->ring, i);
+		i = q->ring.rsp_cons;
+		rsp = RING_GET_RESPONSE(&q->ring, i);
 		LOG(dprint("sdxen rsp %llud %d %d\n", rsp->id, rsp->operation, rsp->status);)
-		if (rsp->status == BLKIF_RSP_OKAY)
-			ctlr->iodone = 1;
+		q->ring.rsp_cons = ++i;
+		if (rsp->id >= q->nreq || q->req[rsp->id].io == nil) {
+			print("sdxen: vbd %d: bogus response id %llud\n", q->ctlr->devid, rsp->id);
+			continue;
+		}
+		r = &q->req[rsp->id];
+		r->status = rsp->status;
+		q->inflight--;
+		latency(q->lat, r->ticks);
+		r->next = nil;
+		if (q->donereq == nil)
+			q->donereq = r;
 		else
-			ctlr->iodone = -1;
-		ctlr->ring.rsp_cons = ++i;
+			q->lastdone->next = r;
+		q->lastdone = r;
+		done = 1;
 	}
-	iunlock(&ctlr->ringlock);
-	if (ctlr->iodone)
-		wakeup(&ctlr->wiodone);
+	iunlock(&q->ringlock);
+	if (done)
+		wakeup(&q->wdone);
 }
 
-static Ctlr *kickctlr;
+static Vbdq *kickq;
 
 static void
 kickme(void)
 {
-	Ctlr *ctlr = kickctlr;
+	Vbdq *q = kickq;
 	shared_info_t *s;
 
-	if (ctlr) {
+	if (q) {
 		s = HYPERVISOR_shared_info;
 		dprint("tick %d %d prod %d cons %d pending %x mask %x\n",
-			 m->ticks, ctlr->iodone, ctlr->ring.sring->rsp_prod, ctlr->ring.rsp_cons,
+			 m->ticks, q->inflight, q->ring.sring->rsp_prod, q->ring.rsp_cons,
 			s->evtchn_pending[0], s->evtchn_mask[0]);
-		sdxenintr(0, ctlr);
+		sdxenintr(0, q);
 	}
 }
 
@@ -260,13 +1095,19 @@ static int
 xenonline(SDunit *unit)
 {
 	Ctlr *ctlr;
+	char name[KNAMELEN];
+	int i;
 
 	ctlr = ((Ctlr**)unit->dev->ctlr)[unit->subno];
 	unit->sectors = ctlr->sectors;
 	unit->secsize = ctlr->secsize;
 	if (ctlr->online == 0) {
-		intrenable(ctlr->evtchn, sdxenintr, ctlr, BUSUNKNOWN, "vbd");
-		//kickctlr = ctlr;
+		for (i = 0; i < ctlr->nq; i++) {
+			snprint(name, sizeof name, "vbd%d.%d", ctlr->devid, i);
+			kproc(name, vbdproc, &ctlr->q[i]);
+			intrenable(ctlr->q[i].evtchn, sdxenintr, &ctlr->q[i], BUSUNKNOWN, "vbd");
+		}
+		//kickq = &ctlr->q[0];
 		//addclock0link(kickme, 10000);
 		backendactivate(ctlr);
 		ctlr->online = 1;
@@ -275,59 +1116,559 @@ xenonline(SDunit *unit)
 	return 1;
 }
 
+/*
+ * issue a request without data and wait for it;
+ * returns the BLKIF_RSP_ status
+ */
 static int
-xenrio(SDreq*)
+vbdop(Ctlr *ctlr, int op, uvlong bno, uvlong nb)
 {
-	return -1;
+	Vbdq *q;
+	Vbdio io;
+	Vbdreq *r;
+
+	memset(&io, 0, sizeof io);
+	q = &ctlr->q[up->pid % ctlr->nq];
+	r = reqalloc(q);
+	r->io = &io;
+	vbdsendop(q, r, op, bno, nb);
+	vbdpush(q);
+	while (waserror())
+		;
+	sleep(&io.done, wiodone, &io);
+	poperror();
+	ilock(&q->ringlock);
+	iunlock(&q->ringlock);
+	return io.error;
+}
+
+/*
+ * make completed writes durable, using whichever of
+ * flush-cache or barrier the backend has;
+ * without either, writes are durable as they complete
+ */
+static int
+xenflush(Ctlr *ctlr)
+{
+	int op, status;
+
+	if (ctlr->flush)
+		op = BLKIF_OP_FLUSH_DISKCACHE;
+	else if (ctlr->barrier)
+		op = BLKIF_OP_WRITE_BARRIER;
+	else
+		return 0;
+	status = vbdop(ctlr, op, 0, 0);
+	if (status == BLKIF_RSP_EOPNOTSUPP) {
+		print("sdxen: vbd %d: cache flush not supported\n", ctlr->devid);
+		if (op == BLKIF_OP_FLUSH_DISKCACHE)
+			ctlr->flush = 0;
+		else
+			ctlr->barrier = 0;
+		return 0;
+	}
+	return status == BLKIF_RSP_OKAY ? 0 : -1;
+}
+
+/*
+ * the bytes of a request of up to nb blocks at bno, cut short of
+ * the rest of a transfer: end it on a physical sector boundary,
+ * so the backend need not read, modify and write physical
+ * sectors shared by two requests
+ */
+static long
+physlen(Ctlr *ctlr, uvlong bno, long nb)
+{
+	ulong ppb;
+	long n;
+
+	ppb = ctlr->physsize/ctlr->secsize;
+	if (ppb > 1 && nb > ppb) {
+		n = (bno+nb) % ppb;
+		if (n < nb)
+			nb -= n;
+	}
+	return nb*ctlr->secsize;
+}
+
+/*
+ * queue requests for nb blocks at bno on q, counted in io,
+ * straight from the caller's buffer, or copied through
+ * persistent grants, or one bounced page at a time if it is
+ * unaligned; only waiting when the ring or the persistent
+ * grant pool is exhausted
+ */
+static void
+vbdqueue(Ctlr *ctlr, Vbdq *q, Vbdio *io, int write, char *data, long nb, uvlong bno)
+{
+	Vbdreq *r;
+	char *buf;
+	long bcount, len, n, m;
+	int aligned;
+
+	/*
+	 * segments address the caller's pages in sectors,
+	 * so any sector-aligned buffer can be granted in place;
+	 * sectors bigger than a page take whole pages
+	 */
+	m = ctlr->secsize < BY2PG ? ctlr->secsize : BY2PG;
+	aligned = ((ulong)data&(m-1)) == 0;
+	if (ctlr->persistent)
+		ctlr->copied++;
+	else if (aligned)
+		ctlr->aligned++;
+	else
+		ctlr->bounced++;
+	for (n = nb; n > 0; n -= bcount) {
+		len = n*ctlr->secsize;
+		r = reqalloc(q);
+		r->io = io;
+		if (ctlr->persistent) {
+			m = (long)ctlr->maxseg*BY2PG;
+			if (len > m)
+				len = physlen(ctlr, bno, m/ctlr->secsize);
+			while ((m = vbdpsegs(q, r, data, len, write, ctlr->maxseg)) == 0) {
+				vbdpush(q);
+				qlock(&q->wpglk);
+				while (waserror())
+					;
+				sleep(&q->wfreepg, wfreepg, q);
+				poperror();
+				qunlock(&q->wpglk);
+			}
+			len = m;
+			if (!write)
+				r->data = data;
+		} else if (aligned) {
+			/* whole sectors within maxseg pages */
+			m = (long)ctlr->maxseg*BY2PG - PGOFF((ulong)data);
+			if (len > m)
+				len = physlen(ctlr, bno, m/ctlr->secsize);
+			refget(q, (PGOFF((ulong)data) + len + BY2PG-1)/BY2PG);
+			vbdsegs(q, r, data, len, write, ctlr->maxseg);
+		} else {
+			buf = r->frame;
+			if (len > ctlr->framesize)
+				len = physlen(ctlr, bno, ctlr->framesize/ctlr->secsize);
+			if (write)
+				memmove(buf, data, len);
+			else {
+				r->data = data;
+				r->len = len;
+			}
+			refget(q, (len + BY2PG-1)/BY2PG);
+			vbdsegs(q, r, buf, len, write, ctlr->framesize/BY2PG);
+		}
+		bcount = len/ctlr->secsize;
+		vbdsend(q, r, write, bno, bcount);
+		data += len;
+		bno += bcount;
+	}
+}
+
+/*
+ * set up the read-ahead buffers, unless *sdxenra=0
+ */
+static void
+rainit(Ctlr *ctlr)
+{
+	char *p;
+	long window, size;
+	int i;
+
+	window = Rawindow;
+	size = Racache;
+	if ((p = getconf("*sdxenra")) != nil)
+		window = strtol(p, 0, 0);
+	if ((p = getconf("*sdxenracache")) != nil)
+		size = strtol(p, 0, 0);
+	window = ROUNDUP(window*1024, BY2PG);
+	if (window <= 0 || window < ctlr->secsize || size*1024 < window)
+		return;
+	ctlr->ra = mallocz((size*1024/window)*sizeof(Rabuf), 1);
+	if (ctlr->ra == nil)
+		return;
+	for (i = 0; i < size*1024/window; i++)
+		if ((ctlr->ra[i].data = mallocalign(window, BY2PG, 0, 0)) == nil)
+			break;
+	ctlr->nra = i;
+	ctlr->rawindow = window/ctlr->secsize;
+	print("sdxen: vbd %d: read-ahead %ldK, %d buffers\n", ctlr->devid, window/1024, ctlr->nra);
+}
+
+/*
+ * copy what the read-ahead buffers hold of nb blocks at bno,
+ * waiting for windows still being read; returns how many
+ * blocks from the start they had
+ */
+static long
+racached(Ctlr *ctlr, char *data, long nb, uvlong bno)
+{
+	Rabuf *b;
+	long n, done;
+	int i;
+
+	for (done = 0; done < nb; done += n) {
+		lock(&ctlr->ralock);
+		for (i = 0; i < ctlr->nra; i++) {
+			b = &ctlr->ra[i];
+			if (b->nb > 0 && !b->stale && bno >= b->bno && bno < b->bno+b->nb)
+				break;
+		}
+		if (i == ctlr->nra) {
+			unlock(&ctlr->ralock);
+			break;
+		}
+		b->busy++;
+		b->used = ++ctlr->raclock;
+		unlock(&ctlr->ralock);
+		if (b->io.pending > 0) {
+			qlock(&b->wlk);
+			while (waserror())
+				;
+			sleep(&b->io.done, wiodone, &b->io);
+			poperror();
+			qunlock(&b->wlk);
+		}
+		n = 0;
+		if (b->io.error == BLKIF_RSP_OKAY && !b->stale) {
+			n = b->bno + b->nb - bno;
+			if (n > nb - done)
+				n = nb - done;
+			memmove(data, b->data + (bno - b->bno)*ctlr->secsize, n*ctlr->secsize);
+		}
+		lock(&ctlr->ralock);
+		b->busy--;
+		unlock(&ctlr->ralock);
+		if (n == 0)
+			break;
+		data += n*ctlr->secsize;
+		bno += n;
+	}
+	return done;
+}
+
+/*
+ * a read of nb blocks at bno is done: if it went on
+ * from the last one, keep a window read ahead of it
+ */
+static void
+raahead(Ctlr *ctlr, uvlong bno, long nb)
+{
+	Rabuf *b, *v;
+	Vbdq *q;
+	uvlong start;
+	long n;
+	int i;
+
+	lock(&ctlr->ralock);
+	if (bno != ctlr->ranext) {
+		ctlr->ranext = bno + nb;
+		unlock(&ctlr->ralock);
+		return;
+	}
+	bno += nb;
+	ctlr->ranext = bno;
+	start = ctlr->rahead > bno ? ctlr->rahead : bno;
+	if (start >= bno + ctlr->rawindow || start >= ctlr->sectors) {
+		unlock(&ctlr->ralock);
+		return;
+	}
+	n = ctlr->rawindow;
+	if (n > ctlr->sectors - start)
+		n = ctlr->sectors - start;
+	/* recycle the least recently used buffer nobody is using */
+	v = nil;
+	for (i = 0; i < ctlr->nra; i++) {
+		b = &ctlr->ra[i];
+		if (b->busy == 0 && b->io.pending == 0 && (v == nil || b->used < v->used))
+			v = b;
+	}
+	if (v == nil) {
+		unlock(&ctlr->ralock);
+		return;
+	}
+	/* make sure vbdproc is done with the last fill's io */
+	if (v->q != nil) {
+		ilock(&v->q->ringlock);
+		iunlock(&v->q->ringlock);
+	}
+	/*
+	 * publish the window before filling it, with a pending
+	 * count of its own to keep readers waiting meanwhile,
+	 * so that a write completing in between finds it and
+	 * marks it stale
+	 */
+	memset(&v->io, 0, sizeof v->io);
+	v->io.pending = 1;
+	q = &ctlr->q[up->pid % ctlr->nq];
+	v->q = q;
+	v->bno = start;
+	v->nb = n;
+	v->stale = 0;
+	v->busy++;
+	ctlr->rahead = start + n;
+	unlock(&ctlr->ralock);
+
+	vbdqueue(ctlr, q, &v->io, 0, v->data, n, start);
+	vbdpush(q);
+	ctlr->raprefetches++;
+	ilock(&q->ringlock);
+	if (--v->io.pending == 0)
+		wakeup(&v->io.done);
+	iunlock(&q->ringlock);
+
+	lock(&ctlr->ralock);
+	v->used = ++ctlr->raclock;
+	v->busy--;
+	unlock(&ctlr->ralock);
+}
+
+/*
+ * nb blocks at bno are being written: what was read ahead of them is stale
+ */
+static void
+rainval(Ctlr *ctlr, uvlong bno, long nb)
+{
+	Rabuf *b;
+	int i;
+
+	if (ctlr->nra == 0)
+		return;
+	lock(&ctlr->ralock);
+	for (i = 0; i < ctlr->nra; i++) {
+		b = &ctlr->ra[i];
+		if (b->nb > 0 && bno < b->bno+b->nb && b->bno < bno+nb)
+			b->stale = 1;
+	}
+	unlock(&ctlr->ralock);
 }
 
 static long
 xenbio(SDunit* unit, int lun, int write, void* data, long nb, uvlong bno)
 {
 	Ctlr *ctlr;
-	char *buf;
-	long bcount, len;
-	int ref;
-	int n;
+	Vbdq *q;
+	Vbdio io;
+	long n;
+	uvlong t0;
 
 	USED(lun);	// XXX meaningless
 	ctlr = ((Ctlr**)unit->dev->ctlr)[unit->subno];
 	LOG(("xenbio %c %lux %ld %lld\n", write? 'w' : 'r', (ulong)data, nb, bno);)
-	buf = data;
-	// XXX extra copying & fragmentation could be avoided by
-	// redefining sdmalloc() to get page-aligned buffers
-	if ((ulong)data&(BY2PG-1))
-		buf = ctlr->frame;
-	bcount = BY2PG/unit->secsize;
-	qlock(&ctlr->iolock);
-	for (n = nb; n > 0; n -= bcount) {
-		ref = shareframe(ctlr->backend, buf, !write);
-		if (bcount > n)
-			bcount = n;
-		len = bcount*unit->secsize;
-		if (write && buf == ctlr->frame)
-			memmove(buf, data, len);
-		ctlr->iodone = 0;
-		if (vbdsend(ctlr, write, ref, bcount, bno))
-			xenchannotify(ctlr->evtchn);
-		LOG(dprint("sleeping %d prod %d cons %d pending %x mask %x \n", ctlr->iodone, ctlr->ring.sring->rsp_prod, ctlr->ring.rsp_cons,
-						HYPERVISOR_shared_info->evtchn_pending[0], HYPERVISOR_shared_info->evtchn_mask[0]);)
-		sleep(&ctlr->wiodone, wiodone, ctlr);
-		xengrantend(ref);
-		if (ctlr->iodone < 0) {
-			qunlock(&ctlr->iolock);
-			return -1;
+	t0 = fastticks(nil);
+	memset(&io, 0, sizeof io);
+	n = 0;
+	if (write)
+		rainval(ctlr, bno, nb);
+	else if (ctlr->nra > 0) {
+		n = racached(ctlr, data, nb, bno);
+		if (n == nb) {
+			ctlr->rahits++;
+			goto done;
 		}
-		if (buf == ctlr->frame) {
-			if (!write)
-				memmove(data, buf, len);
-			data = (char*)data + len;
-		} else
-			buf += len;
-		bno += bcount;
+		ctlr->ramisses++;
+	}
+	/* each process sticks to one queue, keeping its requests in order */
+	q = &ctlr->q[up->pid % ctlr->nq];
+	vbdqueue(ctlr, q, &io, write, (char*)data + n*unit->secsize, nb - n, bno + n);
+	vbdpush(q);
+	LOG(dprint("sleeping %d prod %d cons %d pending %x mask %x \n", io.pending, q->ring.sring->rsp_prod, q->ring.rsp_cons,
+					HYPERVISOR_shared_info->evtchn_pending[0], HYPERVISOR_shared_info->evtchn_mask[0]);)
+	/* the ring holds on to io and the buffer: notes must wait */
+	while (waserror())
+		;
+	sleep(&io.done, wiodone, &io);
+	poperror();
+	/* io is on our stack: make sure sdxenintr is done with it */
+	ilock(&q->ringlock);
+	iunlock(&q->ringlock);
+done:
+	latency(ctlr->lat, t0);
+	if (io.error) {
+		ctlr->errors++;
+		return -1;
+	}
+	if (write) {
+		ctlr->writes++;
+		ctlr->wbytes += nb*unit->secsize;
+		/* in case a window was read ahead while this was written */
+		rainval(ctlr, bno, nb);
+	} else {
+		ctlr->reads++;
+		ctlr->rbytes += nb*unit->secsize;
+		if (ctlr->nra > 0)
+			raahead(ctlr, bno, nb);
+	}
+	if (write && ctlr->writethrough && xenflush(ctlr) < 0)
+		return -1;
+	return nb*unit->secsize;
+}
+
+/*
+ * the non-empty buckets of a latency histogram,
+ * as upper bound in µs and count
+ */
+static int
+latprint(char *p, int l, char *name, ulong *lat)
+{
+	int i, n;
+
+	n = snprint(p, l, "%s", name);
+	for (i = 0; i < Nlat; i++)
+		if (lat[i] != 0)
+			n += snprint(p+n, l-n, " %lud:%lud", 2UL<<i, lat[i]);
+	n += snprint(p+n, l-n, "\n");
+	return n;
+}
+
+static int
+xenrctl(SDunit *unit, char *p, int l)
+{
+	Ctlr *ctlr;
+	Vbdq *q;
+	ulong lat[Nlat];
+	int i, j, n;
+
+	ctlr = ((Ctlr**)unit->dev->ctlr)[unit->subno];
+	if (ctlr == nil || l <= 0)
+		return 0;
+	n = snprint(p, l, "geometry %llud %lud\n", ctlr->sectors, ctlr->secsize);
+	if (ctlr->physsize != ctlr->secsize)
+		n += snprint(p+n, l-n, "physical %lud\n", ctlr->physsize);
+	for (i = 0; i < ctlr->nq; i++) {
+		q = &ctlr->q[i];
+		n += snprint(p+n, l-n, "queue %d qdepth %d max %d avg %llud of %d ring %d",
+			i, q->inflight, q->maxinflight,
+			q->submits? q->depthsum/q->submits : 0, q->nreq, RING_SIZE(&q->ring));
+		n += snprint(p+n, l-n, " segments avg %llud of %d",
+			q->submits? q->segsum/q->submits : 0, ctlr->maxseg);
+		if (ctlr->persistent)
+			n += snprint(p+n, l-n, " persistent %d of %d", q->npg, ctlr->maxref);
+		else
+			n += snprint(p+n, l-n, " grants %d of %d", q->nref, ctlr->maxref);
+		n += snprint(p+n, l-n, " elevator hold %d pending %d merges %lud sorts %lud\n",
+			q->hold, q->npending, q->merges, q->sorts);
+	}
+	n += snprint(p+n, l-n, "transfers aligned %lud bounced %lud copied %lud\n",
+		ctlr->aligned, ctlr->bounced, ctlr->copied);
+	if (ctlr->nra > 0)
+		n += snprint(p+n, l-n, "readahead window %ld buffers %d hits %lud misses %lud prefetches %lud\n",
+			ctlr->rawindow, ctlr->nra, ctlr->rahits, ctlr->ramisses, ctlr->raprefetches);
+	n += snprint(p+n, l-n, "stats reads %lud %llud writes %lud %llud errors %lud grants %lud\n",
+		ctlr->reads, ctlr->rbytes, ctlr->writes, ctlr->wbytes, ctlr->errors, ctlr->grants);
+	/* bucket i counts latencies below 2^(i+1) µs */
+	memset(lat, 0, sizeof lat);
+	for (i = 0; i < ctlr->nq; i++)
+		for (j = 0; j < Nlat; j++)
+			lat[j] += ctlr->q[i].lat[j];
+	n += latprint(p+n, l-n, "latency io", ctlr->lat);
+	n += latprint(p+n, l-n, "latency backend", lat);
+	n += snprint(p+n, l-n, "cache %s%s%s%s\n",
+		ctlr->writethrough? "writethrough" : "writeback",
+		ctlr->flush? " flush" : "", ctlr->barrier? " barrier" : "",
+		ctlr->discard? " discard" : "");
+	return n;
+}
+
+/*
+ * SCSI commands from the raw file, emulated on top of xenbio
+ */
+static int
+xenrio(SDreq *r)
+{
+	SDunit *unit;
+	Ctlr *ctlr;
+	uvlong lba;
+	int i, count, rw;
+
+	unit = r->unit;
+	ctlr = ((Ctlr**)unit->dev->ctlr)[unit->subno];
+	if (r->cmd[0] == 0x35 || r->cmd[0] == 0x91) {	/* synchronize cache */
+		if (xenflush(ctlr) < 0)
+			return sdsetsense(r, SDcheck, 3, 0xc, 2);
+		return sdsetsense(r, SDok, 0, 0, 0);
 	}
-	qunlock(&ctlr->iolock);
-	return (nb-n)*unit->secsize;
+	if ((i = sdfakescsi(r)) != SDnostatus)
+		return r->status = i;
+	if ((i = sdfakescsirw(r, &lba, &count, &rw)) != SDnostatus)
+		return i;
+	if (xenbio(unit, r->lun, rw == SDwrite, r->data, count, lba) < 0)
+		return sdsetsense(r, SDcheck, 3, rw == SDwrite? 0xc : 0x11, 0);
+	r->rlen = count*unit->secsize;
+	return r->status = SDok;
+}
+
+/*
+ *	hold n
+ *	clear
+ *	flush
+ *	discard start count
+ *	cache writeback|writethrough
+ */
+static int
+xenwctl(SDunit *unit, Cmdbuf *cb)
+{
+	Ctlr *ctlr;
+	Vbdq *q;
+	uvlong bno, nb;
+	int i, n, status;
+
+	ctlr = ((Ctlr**)unit->dev->ctlr)[unit->subno];
+	if (strcmp(cb->f[0], "hold") == 0) {
+		if (cb->nf != 2)
+			error(Ebadctl);
+		n = strtol(cb->f[1], 0, 0);
+		if (n < 1)
+			error(Ebadarg);
+		for (i = 0; i < ctlr->nq; i++) {
+			q = &ctlr->q[i];
+			q->hold = n < q->nreq ? n : q->nreq;
+			vbdpush(q);
+		}
+	} else if (strcmp(cb->f[0], "clear") == 0) {
+		/* start the statistics afresh */
+		for (i = 0; i < ctlr->nq; i++) {
+			q = &ctlr->q[i];
+			q->maxinflight = q->inflight;
+			q->submits = 0;
+			q->depthsum = q->segsum = 0;
+			memset(q->lat, 0, sizeof q->lat);
+		}
+		ctlr->reads = ctlr->writes = ctlr->errors = ctlr->grants = 0;
+		ctlr->rbytes = ctlr->wbytes = 0;
+		ctlr->rahits = ctlr->ramisses = ctlr->raprefetches = 0;
+		memset(ctlr->lat, 0, sizeof ctlr->lat);
+	} else if (strcmp(cb->f[0], "flush") == 0) {
+		if (xenflush(ctlr) < 0)
+			error(Eio);
+	} else if (strcmp(cb->f[0], "discard") == 0) {
+		if (cb->nf != 3)
+			error(Ebadctl);
+		if (!ctlr->discard)
+			error("discard not supported by backend");
+		bno = strtoull(cb->f[1], 0, 0);
+		nb = strtoull(cb->f[2], 0, 0);
+		if (nb == 0 || bno >= unit->sectors || nb > unit->sectors - bno)
+			error(Ebadarg);
+		rainval(ctlr, bno, nb);
+		status = vbdop(ctlr, BLKIF_OP_DISCARD, bno, nb);
+		if (status == BLKIF_RSP_EOPNOTSUPP)
+			ctlr->discard = 0;
+		if (status != BLKIF_RSP_OKAY)
+			error(Eio);
+	} else if (strcmp(cb->f[0], "cache") == 0) {
+		if (cb->nf != 2)
+			error(Ebadctl);
+		if (strcmp(cb->f[1], "writeback") == 0)
+			ctlr->writethrough = 0;
+		else if (strcmp(cb->f[1], "writethrough") == 0)
+			ctlr->writethrough = 1;
+		else
+			error(Ebadctl);
+	} else
+		error(Ebadctl);
+	return 0;
 }
 
 static void
@@ -346,8 +1687,8 @@ SDifc sdxenifc = {
 	xenverify,			/* verify */
 	xenonline,			/* online */
 	xenrio,				/* rio */
-	0,			/* rctl */
-	0,			/* wctl */
+	xenrctl,			/* rctl */
+	xenwctl,			/* wctl */
 
 	xenbio,				/* bio */
 	0,			/* probe */
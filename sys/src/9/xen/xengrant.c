@@ -10,13 +10,15 @@
 #define LOG(a) // a;
 
 enum {
-	Nframes = 4,
+	Nframes = 8,	/* mapped at XENGRANTTAB, below KTZERO */
+	Nspare = 512,	/* refs not for xengrantreserve: rings and such */
 };
 
 static struct {
 	Lock;
-	ushort free;
+	ushort free;	/* 0 when there are none: ref 0 is reserved */
 	ushort *refs;
+	int unreserved;
 } refalloc;
 
 static grant_entry_t * granttab;
@@ -41,6 +43,7 @@ xengrantinit(void)
 	for (i = 0; i < nrefs; i++)
 		refalloc.refs[i] = i-1;
 	refalloc.free = nrefs-1;
+	refalloc.unreserved = nrefs - Nspare;
 	LOG(dprint("xengrantinit %d %d\n", nrefs, refalloc.free))
 }
 
@@ -51,8 +54,11 @@ allocref(void)
 
 	ilock(&refalloc);
 	ref = refalloc.free;
-	if (ref > 0)
-		refalloc.free = refalloc.refs[ref];
+	if (ref == 0) {
+		iunlock(&refalloc);
+		return -1;
+	}
+	refalloc.free = refalloc.refs[ref];
 	iunlock(&refalloc);
 	LOG(dprint("allocref %d\n", ref))
 	return ref;
@@ -68,6 +74,22 @@ freeref(int ref)
 	LOG(dprint("freeref %d\n", ref))
 }
 
+/*
+ * Drivers that may tie up many refs at once size themselves
+ * by what they reserve here, up to n, so that together they
+ * stay within the table; a negative n gives refs back.
+ */
+int
+xengrantreserve(int n)
+{
+	ilock(&refalloc);
+	if (n > refalloc.unreserved)
+		n = refalloc.unreserved;
+	refalloc.unreserved -= n;
+	iunlock(&refalloc);
+	return n;
+}
+
 int
 xengrant(domid_t domid, ulong frame, int flags)
 {
@@ -107,3 +129,22 @@ xengrantend(int ref)
 	LOG(dprint("xengrantend %d\n", frame, ref))
 	return frame;
 }
+
+/*
+ * Allocate a zeroed shared ring of 1<<order pages for a frontend,
+ * granting each page to domid and storing the refs in refs[]
+ */
+void*
+xenringalloc(domid_t domid, int order, int *refs)
+{
+	char *p;
+	int i;
+
+	p = xspanalloc(BY2PG<<order, BY2PG, 0);
+	if (p == nil)
+		panic("xenringalloc: no memory");
+	memset(p, 0, BY2PG<<order);
+	for (i = 0; i < 1<<order; i++)
+		refs[i] = shareframe(domid, p + i*BY2PG, 1);
+	return p;
+}